@@ -0,0 +1,4 @@
+# Builds everything, then runs every workload in bench/ under emu
+# Extra arguments go to the harness, e.g. ./bench.sh -n 10 -e --jit
+./build.sh || exit 1
+./harness "$@" bench/*.asm
@@ -0,0 +1,19 @@
+; Tight ALU loop: adds, subtracts, ors and multiplies on registers only
+main:
+	ori s0 zero 500
+outer:
+	ori t0 zero 10000
+inner:
+	addu t1 t1 t0
+	addiu t2 t2 7
+	sub t3 t1 t2
+	ori t4 t3 0x55
+	multu t4 t0
+	addu t5 t4 t3
+	addiu t0 t0 -1
+	bne t0 zero inner
+	addiu s0 s0 -1
+	bne s0 zero outer
+	addiu a0 zero 0
+	addiu v0 zero 0x4001
+	syscall
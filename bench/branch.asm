@@ -0,0 +1,93 @@
+; Branch-heavy: walks a table of 64 random bits 100000 times, branching on each
+main:
+	lui at table
+	ori s0 at table
+	; 100000 passes, more than ori takes
+	ori s2 zero 50000
+	addu s2 s2 s2
+pass:
+	addu t1 s0 zero
+	ori t0 zero 64
+step:
+	lb t2 [t1 + 0]
+	beq t2 zero clear
+	nop
+	addiu a1 a1 1
+	j next
+	nop
+clear:
+	addiu a2 a2 1
+next:
+	addiu t1 t1 1
+	addiu t0 t0 -1
+	bne t0 zero step
+	addiu s2 s2 -1
+	bne s2 zero pass
+	addiu a0 zero 0
+	addiu v0 zero 0x4001
+	syscall
+table:
+	db 1
+	db 0
+	db 1
+	db 0
+	db 0
+	db 0
+	db 1
+	db 0
+	db 0
+	db 0
+	db 0
+	db 1
+	db 1
+	db 0
+	db 0
+	db 0
+	db 1
+	db 0
+	db 0
+	db 0
+	db 0
+	db 1
+	db 0
+	db 0
+	db 0
+	db 0
+	db 1
+	db 1
+	db 0
+	db 0
+	db 1
+	db 0
+	db 0
+	db 0
+	db 1
+	db 0
+	db 0
+	db 0
+	db 0
+	db 1
+	db 1
+	db 1
+	db 1
+	db 1
+	db 1
+	db 1
+	db 0
+	db 0
+	db 0
+	db 0
+	db 1
+	db 1
+	db 1
+	db 1
+	db 1
+	db 0
+	db 0
+	db 1
+	db 0
+	db 1
+	db 0
+	db 1
+	db 1
+	db 0
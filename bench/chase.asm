@@ -0,0 +1,44 @@
+; Pointer chasing round a ring of 16384 64 byte nodes in 1 MiB of stack.
+; The ring visits node k, k + 64, k + 128, ... for each k < 64 in turn,
+; so consecutive loads are a page apart.
+main:
+	addu s0 sp zero
+	ori t0 zero 32
+reserve:
+	addiu s0 s0 -32768
+	addiu t0 t0 -1
+	bne t0 zero reserve
+
+	addu s1 s0 zero
+	addu t5 s0 zero
+	ori t6 zero 64
+group:
+	addu t1 t5 zero
+	ori t0 zero 256
+link:
+	sw t1 [s1 + 0]
+	addu s1 t1 zero
+	addiu t1 t1 4096
+	addiu t0 t0 -1
+	bne t0 zero link
+	addiu t5 t5 64
+	addiu t6 t6 -1
+	bne t6 zero group
+	sw s0 [s1 + 0]
+
+	addu t1 s0 zero
+	ori s2 zero 100
+outer:
+	ori t0 zero 65535
+chase:
+	lw t1 [t1 + 0]
+	lw t1 [t1 + 0]
+	lw t1 [t1 + 0]
+	lw t1 [t1 + 0]
+	addiu t0 t0 -1
+	bne t0 zero chase
+	addiu s2 s2 -1
+	bne s2 zero outer
+	addiu a0 zero 0
+	addiu v0 zero 0x4001
+	syscall
@@ -0,0 +1,23 @@
+; Copies 32 KiB between two buffers on the stack, two words at a time, 1000 times
+main:
+	addiu s1 sp -32768
+	addiu s2 s1 -32768
+	ori s0 zero 1000
+pass:
+	addu t0 s2 zero
+	addu t1 s1 zero
+	ori t3 zero 4096
+copy:
+	lw t2 [t0 + 0]
+	sw t2 [t1 + 0]
+	lw t4 [t0 + 4]
+	sw t4 [t1 + 4]
+	addiu t0 t0 8
+	addiu t1 t1 8
+	addiu t3 t3 -1
+	bne t3 zero copy
+	addiu s0 s0 -1
+	bne s0 zero pass
+	addiu a0 zero 0
+	addiu v0 zero 0x4001
+	syscall
@@ -0,0 +1,34 @@
+; 200000 one line writes to stdout
+main:
+	lui at msg
+	ori s1 at msg
+	ori s0 zero 50000
+again:
+	addiu a0 zero 1
+	addu a1 s1 zero
+	addiu a2 zero 11
+	addiu v0 zero 4004
+	syscall
+	addiu a0 zero 1
+	addu a1 s1 zero
+	addiu a2 zero 11
+	addiu v0 zero 4004
+	syscall
+	addiu a0 zero 1
+	addu a1 s1 zero
+	addiu a2 zero 11
+	addiu v0 zero 4004
+	syscall
+	addiu a0 zero 1
+	addu a1 s1 zero
+	addiu a2 zero 11
+	addiu v0 zero 4004
+	syscall
+	addiu s0 s0 -1
+	bne s0 zero again
+	addiu a0 zero 0
+	addiu v0 zero 4001
+	syscall
+msg:
+	db "MIPS HELLO"
+	db 0xa
@@ -1,2 +1,6 @@
-clang -O3 src/emu.c -o emu
+clang -O3 -pthread src/emu.c -o emu
+clang -O3 -pthread -c src/mipsemu.c -o mipsemu.o && ar rcs libmipsemu.a mipsemu.o
 clang -O3 -Wno-void-pointer-to-enum-cast src/asm.c -o asm
+clang -O3 src/recomp.c -o recomp
+clang -O3 src/tracedump.c -o tracedump
+clang -O3 src/harness.c -o harness -lm
@@ -25,7 +25,9 @@ typedef enum Op {
 	Op_Bne, Op_Beq,
 	Op_Lb, Op_Sb,
 	Op_Lw, Op_Sw,
-	Op_Data, Op_Syscall
+	Op_Data, Op_Syscall,
+	Op_Ll, Op_Sc,
+	Op_Sync
 } Op;
 
 typedef enum Register {
@@ -232,6 +234,7 @@ void expected_args(Op op, u32 *expected_reg, u32 *expected_imm, u32 *expected_ad
 	switch (op) {
 		case Op_Syscall: { *expected_reg = *expected_imm = *expected_addr = 0; } break;
 		case Op_Nop: {     *expected_reg = *expected_imm = *expected_addr = 0; } break;
+		case Op_Sync: {    *expected_reg = *expected_imm = *expected_addr = 0; } break;
 		case Op_Mult: {  r2_args(expected_reg, expected_imm, expected_addr); } break;
 		case Op_Multu: { r2_args(expected_reg, expected_imm, expected_addr); } break;
 		case Op_Add: {   r_args(expected_reg, expected_imm, expected_addr); } break;
@@ -251,6 +254,8 @@ void expected_args(Op op, u32 *expected_reg, u32 *expected_imm, u32 *expected_ad
 		case Op_Sb: {    d_args(expected_reg, expected_imm, expected_addr); } break;
 		case Op_Sw: {    d_args(expected_reg, expected_imm, expected_addr); } break;
 		case Op_Lw: {    d_args(expected_reg, expected_imm, expected_addr); } break;
+		case Op_Ll: {    d_args(expected_reg, expected_imm, expected_addr); } break;
+		case Op_Sc: {    d_args(expected_reg, expected_imm, expected_addr); } break;
 		default: {
 			printf("Unhandled op (Expected Args): %x\n", op);
 		}
@@ -260,18 +265,23 @@ void expected_args(Op op, u32 *expected_reg, u32 *expected_imm, u32 *expected_ad
 int main(int argc, char *argv[]) {
 	if (argc < 3) {
 usage:
-		fprintf(stderr, "Usage: %s [-e] <in_file> <out_file>\n\t-e is for elf\n", argv[0]);
+		fprintf(stderr, "Usage: %s [-e] [-m <map_file>] <in_file> <out_file>\n\t-e is for elf\n"
+				"\t-m writes each label's address to map_file, for emu --symbols\n", argv[0]);
 		return 1;
 	}
 
 	bool use_elf = false;
+	char *map_file = NULL;
 
 	int opt;
-	while ((opt = getopt(argc, argv, "eh")) != -1) {
+	while ((opt = getopt(argc, argv, "em:h")) != -1) {
 		switch (opt) {
 			case 'e': {
 				use_elf = true;
 			} break;
+			case 'm': {
+				map_file = optarg;
+			} break;
 			case 'h': {
 				goto usage;
 			} break;
@@ -315,6 +325,9 @@ usage:
 	map_insert(op_map, "lw", (void *)Op_Lw);
 	map_insert(op_map, "sb", (void *)Op_Sb);
 	map_insert(op_map, "sw", (void *)Op_Sw);
+	map_insert(op_map, "ll", (void *)Op_Ll);
+	map_insert(op_map, "sc", (void *)Op_Sc);
+	map_insert(op_map, "sync", (void *)Op_Sync);
 
 	reg_map = map_init();
 	map_insert(reg_map, "zero", (void *)Reg_zero);
@@ -686,7 +699,7 @@ usage:
 		cur_section->end_idx = insts.size - 1;
 	}
 
-	u32 mem_start = 0x400000 + sizeof(Elf32_hdr) + sizeof(Program_hdr);
+	u32 mem_start = FLAT_BASE;
 	for (u32 i = 0; i < symbol_map->capacity; i++) {
 		if (symbol_map->m[i].key != NULL) {
 			Symbol *sym_s = (Symbol *)symbol_map->m[i].data;
@@ -711,6 +724,22 @@ usage:
 		}
 	}
 
+	if (map_file != NULL) {
+		FILE *map_out = fopen(map_file, "w");
+		if (map_out == NULL) {
+			printf("Unable to open %s!\n", map_file);
+			return 1;
+		}
+
+		for (u32 i = 0; i < label_map->capacity; i++) {
+			if (label_map->m[i].key != NULL) {
+				Symbol *lab_s = (Symbol *)label_map->m[i].data;
+				fprintf(map_out, "%08x %s\n", mem_start + lab_s->inst_off, label_map->m[i].key);
+			}
+		}
+		fclose(map_out);
+	}
+
 	for (u32 i = 0; i < section_map->capacity; i++) {
 		Bucket b = section_map->m[i];
 		if (b.key != NULL) {
@@ -763,6 +792,7 @@ usage:
 		switch (inst.op) {
 			case Op_Syscall: { inst_bytes = 0xc; } break;
 			case Op_Nop: {   inst_bytes = 0; } break;
+			case Op_Sync: {  inst_bytes = 0xf; } break;
 			case Op_J: {     inst_bytes = 0x2 << 26 | inst.instr_idx; } break;
 			case Op_Jal: {   inst_bytes = 0x3 << 26 | inst.instr_idx; } break;
 			case Op_Jr: {    inst_bytes = inst.reg[0] << 21 | 0x8; } break;
@@ -782,6 +812,8 @@ usage:
 			case Op_Lw: {    inst_bytes = 0x23 << 26 | inst.reg[1] << 21 | inst.reg[0] << 16 | (u16)inst.imm; } break;
 			case Op_Sb: {    inst_bytes = 0x28 << 26 | inst.reg[1] << 21 | inst.reg[0] << 16 | (u16)inst.imm; } break;
 			case Op_Sw: {    inst_bytes = 0x2B << 26 | inst.reg[1] << 21 | inst.reg[0] << 16 | (u16)inst.imm; } break;
+			case Op_Ll: {    inst_bytes = 0x30 << 26 | inst.reg[1] << 21 | inst.reg[0] << 16 | (u16)inst.imm; } break;
+			case Op_Sc: {    inst_bytes = 0x38 << 26 | inst.reg[1] << 21 | inst.reg[0] << 16 | (u16)inst.imm; } break;
 			default: {
 				printf("Unhandled op (Bin Generator): %x\n", inst.op);
 				return 1;
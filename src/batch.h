@@ -0,0 +1,267 @@
+/*
+ * emu --batch: runs every job in a manifest on a pool of host threads.
+ * Included by emu.c after the interpreter and run_guest().
+ *
+ * A manifest has one job per line, "<binary> [<input>]"; blank lines and
+ * lines starting with # are skipped. Each job gets its own Machine, so
+ * its own registers, guest memory and blocks, but jobs running the same
+ * binary share one predecoded copy of its text (see code_own). Jobs are
+ * dealt round robin onto per-worker deques; a worker pops from the back
+ * of its own and steals from the front of the others once it runs dry.
+ */
+
+#define BATCH_MAX_TEXTS 256
+
+typedef struct Text {
+	char *path;
+	Decoded *code;
+	bool ok;
+} Text;
+
+typedef struct Job {
+	char *path;
+	char *input;
+	Text *text;
+	int status;
+	double ms;
+
+	// Only used by the scheduler, see timeslice.h
+	Machine *m;
+	double wake_us;
+} Job;
+
+typedef struct Worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	u32 *deque;
+	u32 front;
+	u32 back;
+	struct Batch *batch;
+} Worker;
+
+typedef struct Batch {
+	Job *jobs;
+	u32 num_jobs;
+	Text texts[BATCH_MAX_TEXTS];
+	u32 num_texts;
+
+	Worker *workers;
+	u32 num_workers;
+
+	int (*run)(Machine *);
+	bool use_jit;
+	char *cache_dir;
+} Batch;
+
+bool batch_read_manifest(Batch *b, char *path) {
+	FILE *in = fopen(path, "r");
+	if (in == NULL) {
+		printf("%s not found!\n", path);
+		return false;
+	}
+
+	u32 cap = 64;
+	b->jobs = (Job *)calloc(cap, sizeof(Job));
+
+	char line[8192];
+	while (fgets(line, sizeof(line), in) != NULL) {
+		char *save;
+		char *bin = strtok_r(line, " \t\r\n", &save);
+		if (bin == NULL || bin[0] == '#') {
+			continue;
+		}
+		char *input = strtok_r(NULL, " \t\r\n", &save);
+
+		if (b->num_jobs == cap) {
+			cap *= 2;
+			b->jobs = (Job *)realloc(b->jobs, cap * sizeof(Job));
+		}
+
+		Job *job = &b->jobs[b->num_jobs++];
+		memset(job, 0, sizeof(Job));
+		job->path = strdup(bin);
+		job->input = input != NULL ? strdup(input) : NULL;
+	}
+
+	fclose(in);
+	return true;
+}
+
+// Decodes each distinct binary once, up front, for its jobs to share
+bool batch_prepare_texts(Batch *b) {
+	for (u32 i = 0; i < b->num_jobs; i++) {
+		Job *job = &b->jobs[i];
+
+		for (u32 t = 0; t < b->num_texts; t++) {
+			if (strcmp(b->texts[t].path, job->path) == 0) {
+				job->text = &b->texts[t];
+			}
+		}
+		if (job->text != NULL) {
+			continue;
+		}
+
+		if (b->num_texts == BATCH_MAX_TEXTS) {
+			printf("Too many distinct binaries, the limit is %u!\n", BATCH_MAX_TEXTS);
+			return false;
+		}
+
+		Text *text = &b->texts[b->num_texts++];
+		text->path = job->path;
+		job->text = text;
+
+		Machine m = {0};
+		if (!load_program(&m, job->path)) {
+			continue;
+		}
+
+		predecode(&m, b->cache_dir);
+		text->code = m.code;
+		text->ok = true;
+
+		free(m.blocks);
+		free(m.in_block);
+		unload_program(&m);
+	}
+
+	return true;
+}
+
+bool batch_load_job(Batch *b, Job *job, Machine *m) {
+	if (!job->text->ok || !load_program(m, job->path)) {
+		job->status = -1;
+		return false;
+	}
+	if (job->input != NULL && !load_input(m, job->input)) {
+		unload_program(m);
+		job->status = -1;
+		return false;
+	}
+
+	m->code = job->text->code;
+	m->code_shared = true;
+	blocks_init(m);
+
+	if (b->use_jit) {
+		m->jit = jit_init();
+	}
+
+	return true;
+}
+
+void batch_free_job(Machine *m) {
+	blocks_free(m);
+	if (!m->code_shared) {
+		free(m->code);
+	}
+	if (m->jit != NULL) {
+		jit_free(m->jit);
+	}
+	unload_program(m);
+}
+
+void batch_run_job(Batch *b, Job *job) {
+	double start = now_us();
+
+	Machine m = {0};
+	if (!batch_load_job(b, job, &m)) {
+		return;
+	}
+
+	job->status = run_guest(b->run, &m) & 0xFF;
+	job->ms = (now_us() - start) / 1000;
+
+	batch_free_job(&m);
+}
+
+bool batch_pop(Worker *w, u32 *job) {
+	pthread_mutex_lock(&w->lock);
+	bool ok = w->front != w->back;
+	if (ok) {
+		*job = w->deque[--w->back];
+	}
+	pthread_mutex_unlock(&w->lock);
+	return ok;
+}
+
+bool batch_steal(Worker *w, u32 *job) {
+	pthread_mutex_lock(&w->lock);
+	bool ok = w->front != w->back;
+	if (ok) {
+		*job = w->deque[w->front++];
+	}
+	pthread_mutex_unlock(&w->lock);
+	return ok;
+}
+
+void *batch_worker(void *arg) {
+	Worker *w = (Worker *)arg;
+	Batch *b = w->batch;
+	u32 self = w - b->workers;
+
+	while (true) {
+		u32 job;
+		bool found = batch_pop(w, &job);
+
+		// Jobs are all queued before the workers start, so once every
+		// deque is empty there is nothing left to wait for
+		for (u32 i = 1; !found && i < b->num_workers; i++) {
+			found = batch_steal(&b->workers[(self + i) % b->num_workers], &job);
+		}
+		if (!found) {
+			break;
+		}
+
+		batch_run_job(b, &b->jobs[job]);
+	}
+
+	return NULL;
+}
+
+int batch_report(Batch *b, double total_ms) {
+	u32 failed = 0;
+	for (u32 i = 0; i < b->num_jobs; i++) {
+		Job *job = &b->jobs[i];
+		if (job->status == -1) {
+			printf("%s%s%s: failed to load\n", job->path, job->input ? " " : "", job->input ? job->input : "");
+			failed++;
+		} else {
+			printf("%s%s%s: exit %d, %.3f ms\n", job->path, job->input ? " " : "", job->input ? job->input : "",
+				job->status, job->ms);
+		}
+	}
+	printf("%u jobs on %u threads in %.3f ms\n", b->num_jobs, b->num_workers, total_ms);
+
+	return failed > 0;
+}
+
+int run_batch(Batch *b, char *manifest, u32 num_workers) {
+	if (!batch_read_manifest(b, manifest) || !batch_prepare_texts(b)) {
+		return 1;
+	}
+
+	double start = now_us();
+
+	b->num_workers = num_workers;
+	b->workers = (Worker *)calloc(num_workers, sizeof(Worker));
+	for (u32 i = 0; i < num_workers; i++) {
+		Worker *w = &b->workers[i];
+		w->batch = b;
+		w->deque = (u32 *)malloc((b->num_jobs / num_workers + 1) * sizeof(u32));
+		pthread_mutex_init(&w->lock, NULL);
+	}
+
+	for (u32 i = 0; i < b->num_jobs; i++) {
+		Worker *w = &b->workers[i % num_workers];
+		w->deque[w->back++] = i;
+	}
+
+	for (u32 i = 0; i < num_workers; i++) {
+		pthread_create(&b->workers[i].thread, NULL, batch_worker, &b->workers[i]);
+	}
+	for (u32 i = 0; i < num_workers; i++) {
+		pthread_join(b->workers[i].thread, NULL);
+	}
+
+	return batch_report(b, (now_us() - start) / 1000);
+}
@@ -0,0 +1,335 @@
+#ifndef CACHESIM_H
+#define CACHESIM_H
+
+#include "common.h"
+#include "mips.h"
+#include "machine.h"
+
+/*
+ * Cache hierarchy model, fed from the interpreter's profiling hooks: every
+ * block entered is fetched through L1I a line at a time, and every load
+ * and store goes through L1D. Both L1s miss into a shared L2 (if there is
+ * one) and from there into memory. Caches are write-back and
+ * write-allocate, so a dirty line that gets evicted is written to the
+ * level below. Only hit and miss counts are kept, never any data.
+ *
+ * A level remembers the last line it hit, and an access to that line
+ * again skips the set lookup: loops over arrays and straight-line fetch
+ * mostly take that path, so long runs stay affordable.
+ *
+ * Levels are set up from a spec like
+ *   l1i=32k:4:32:lru,l1d=32k:4:32:lru,l2=256k:8:32:lru
+ * giving size, ways, line size and replacement policy (lru, fifo or
+ * random) for each of l1i, l1d and l2; leave a level out to not model it.
+ */
+
+#define CACHESIM_DEFAULT "l1i=32k:4:32:lru,l1d=32k:4:32:lru,l2=256k:8:32:lru"
+#define CACHESIM_TOP_PCS 20
+
+enum {
+	Policy_Lru,
+	Policy_Fifo,
+	Policy_Random,
+};
+
+typedef struct CacheLevel {
+	char name[4];
+	u32 size;
+	u32 ways;
+	u32 line_size;
+	u8 policy;
+
+	u32 line_shift;
+	u32 set_mask;
+	// Per way of every set: line number + 1 (0 is empty), last use or
+	// fill time, and whether it was written
+	u32 *tags;
+	u64 *stamps;
+	u8 *dirty;
+	u64 clock;
+	u32 rng;
+
+	u32 last_line;
+	u32 last_slot;
+
+	u64 accesses;
+	u64 misses;
+	u64 writebacks;
+
+	struct CacheLevel *next;
+} CacheLevel;
+
+typedef struct CacheSim {
+	CacheLevel *l1i;
+	CacheLevel *l1d;
+	CacheLevel *l2;
+
+	u32 code_base;
+	u32 code_size;
+	// Per word of text: L1 misses it caused, and misses that went all the way to memory
+	u64 *l1_misses;
+	u64 *mem_misses;
+} CacheSim;
+
+static bool cachesim_pow2(u32 x) {
+	return x != 0 && (x & (x - 1)) == 0;
+}
+
+static u32 cachesim_log2(u32 x) {
+	u32 n = 0;
+	while ((1u << n) < x) {
+		n++;
+	}
+	return n;
+}
+
+// Parses "<size>[k|m]:<ways>:<line>[:<policy>]"
+static CacheLevel *cachesim_level(char *name, char *spec) {
+	char *end;
+	u64 size = strtoull(spec, &end, 0);
+	if (*end == 'k' || *end == 'K') {
+		size <<= 10;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		size <<= 20;
+		end++;
+	}
+
+	u32 ways = 0;
+	u32 line_size = 0;
+	char policy[16] = "lru";
+	if (sscanf(end, ":%u:%u:%15s", &ways, &line_size, policy) < 2) {
+		printf("%s: expected <size>:<ways>:<line>[:<policy>], got %s\n", name, spec);
+		return NULL;
+	}
+
+	CacheLevel *l = (CacheLevel *)calloc(1, sizeof(CacheLevel));
+	snprintf(l->name, sizeof(l->name), "%s", name);
+	l->size = size;
+	l->ways = ways;
+	l->line_size = line_size;
+	l->rng = 0x9E3779B9;
+
+	if (strcmp(policy, "lru") == 0) {
+		l->policy = Policy_Lru;
+	} else if (strcmp(policy, "fifo") == 0) {
+		l->policy = Policy_Fifo;
+	} else if (strcmp(policy, "random") == 0) {
+		l->policy = Policy_Random;
+	} else {
+		printf("%s: unknown replacement policy %s, expected lru, fifo or random\n", name, policy);
+		free(l);
+		return NULL;
+	}
+
+	u64 sets = ways && line_size ? size / ways / line_size : 0;
+	if (!cachesim_pow2(line_size) || line_size < 4 || !cachesim_pow2(sets) || sets * ways * line_size != size) {
+		printf("%s: size / ways / line has to come out as a power of two number of sets,"
+			" with a power of two line of at least 4 bytes\n", name);
+		free(l);
+		return NULL;
+	}
+
+	l->line_shift = cachesim_log2(line_size);
+	l->set_mask = sets - 1;
+	l->tags = (u32 *)calloc(sets * ways, sizeof(u32));
+	l->stamps = (u64 *)calloc(sets * ways, sizeof(u64));
+	l->dirty = (u8 *)calloc(sets * ways, sizeof(u8));
+	l->last_line = -1;
+
+	return l;
+}
+
+CacheSim *cachesim_init(Machine *m, char *spec) {
+	CacheSim *c = (CacheSim *)calloc(1, sizeof(CacheSim));
+	c->code_base = m->code_base;
+	c->code_size = m->code_size;
+	c->l1_misses = (u64 *)calloc(m->code_size + 1, sizeof(u64));
+	c->mem_misses = (u64 *)calloc(m->code_size + 1, sizeof(u64));
+
+	char *copy = strdup(strcmp(spec, "default") == 0 ? CACHESIM_DEFAULT : spec);
+	char *save;
+	for (char *part = strtok_r(copy, ",", &save); part != NULL; part = strtok_r(NULL, ",", &save)) {
+		char *eq = strchr(part, '=');
+		if (eq == NULL) {
+			printf("Expected <level>=<size>:<ways>:<line>[:<policy>], got %s\n", part);
+			return NULL;
+		}
+		*eq = '\0';
+
+		CacheLevel **slot = NULL;
+		if (strcmp(part, "l1i") == 0) {
+			slot = &c->l1i;
+		} else if (strcmp(part, "l1d") == 0) {
+			slot = &c->l1d;
+		} else if (strcmp(part, "l2") == 0) {
+			slot = &c->l2;
+		} else {
+			printf("Unknown cache level %s, expected l1i, l1d or l2\n", part);
+			return NULL;
+		}
+
+		*slot = cachesim_level(part, eq + 1);
+		if (*slot == NULL) {
+			return NULL;
+		}
+	}
+	free(copy);
+
+	if (c->l1i != NULL) c->l1i->next = c->l2;
+	if (c->l1d != NULL) c->l1d->next = c->l2;
+
+	return c;
+}
+
+/*
+ * Looks addr up in l and the levels below it, filling the line in on the
+ * way back. Returns how many levels missed.
+ */
+static u32 cachesim_access(CacheLevel *l, u32 addr, bool write) {
+	if (l == NULL) {
+		return 0;
+	}
+
+	l->accesses++;
+	u32 line = addr >> l->line_shift;
+	if (line == l->last_line) {
+		l->dirty[l->last_slot] |= write;
+		return 0;
+	}
+
+	u32 base = (line & l->set_mask) * l->ways;
+	l->clock++;
+	for (u32 w = 0; w < l->ways; w++) {
+		u32 slot = base + w;
+		if (l->tags[slot] == line + 1) {
+			if (l->policy == Policy_Lru) {
+				l->stamps[slot] = l->clock;
+			}
+			l->dirty[slot] |= write;
+			l->last_line = line;
+			l->last_slot = slot;
+			return 0;
+		}
+	}
+
+	l->misses++;
+
+	// An empty way if there is one, otherwise the policy's pick
+	u32 victim = base;
+	bool full = true;
+	for (u32 w = 0; w < l->ways; w++) {
+		u32 slot = base + w;
+		if (l->tags[slot] == 0) {
+			victim = slot;
+			full = false;
+			break;
+		}
+		if (l->stamps[slot] < l->stamps[victim]) {
+			victim = slot;
+		}
+	}
+
+	if (full && l->policy == Policy_Random) {
+		l->rng ^= l->rng << 13;
+		l->rng ^= l->rng >> 17;
+		l->rng ^= l->rng << 5;
+		victim = base + l->rng % l->ways;
+	}
+
+	if (l->tags[victim] != 0 && l->dirty[victim]) {
+		l->writebacks++;
+		cachesim_access(l->next, (l->tags[victim] - 1) << l->line_shift, true);
+	}
+
+	u32 below = cachesim_access(l->next, addr, false);
+
+	l->tags[victim] = line + 1;
+	l->stamps[victim] = l->clock;
+	l->dirty[victim] = write;
+	l->last_line = line;
+	l->last_slot = victim;
+
+	return 1 + below;
+}
+
+static inline void cachesim_count(CacheSim *c, u32 idx, u32 missed) {
+	if (missed > 0) {
+		c->l1_misses[idx]++;
+		c->mem_misses[idx] += missed == 1 + (c->l2 != NULL);
+	}
+}
+
+// Fetches the words of a block, charging each line's miss to the first of them to need it
+static inline void cachesim_fetch(CacheSim *c, u32 pc, u32 len) {
+	CacheLevel *l = c->l1i;
+	if (l == NULL) {
+		return;
+	}
+
+	u32 first = pc >> l->line_shift;
+	u32 last = (pc + len * 4 - 1) >> l->line_shift;
+	for (u32 line = first; line <= last; line++) {
+		u32 addr = line << l->line_shift;
+		if (addr < pc) {
+			addr = pc;
+		}
+
+		u32 missed = cachesim_access(l, addr, false);
+		cachesim_count(c, (addr - c->code_base) / 4, missed);
+	}
+}
+
+static inline void cachesim_data(CacheSim *c, u32 idx, u32 addr, bool write) {
+	if (c->l1d != NULL) {
+		cachesim_count(c, idx, cachesim_access(c->l1d, addr, write));
+	}
+}
+
+static void cachesim_level_report(CacheLevel *l, FILE *out) {
+	if (l == NULL) {
+		return;
+	}
+
+	fprintf(out, "  %-4s %6uK %2u-way %3uB lines  %12lu accesses %12lu misses (%5.2f%%) %10lu writebacks\n",
+		l->name, l->size >> 10, l->ways, l->line_size, l->accesses, l->misses,
+		l->accesses ? 100.0 * l->misses / l->accesses : 0.0, l->writebacks);
+}
+
+static int cachesim_by_misses(const void *a, const void *b, void *counts) {
+	u64 ca = ((u64 *)counts)[*(u32 *)a];
+	u64 cb = ((u64 *)counts)[*(u32 *)b];
+	if (ca != cb) {
+		return ca < cb ? 1 : -1;
+	}
+	return *(u32 *)a < *(u32 *)b ? -1 : 1;
+}
+
+void cachesim_report(CacheSim *c, Machine *m, FILE *out) {
+	fprintf(out, "caches:\n");
+	cachesim_level_report(c->l1i, out);
+	cachesim_level_report(c->l1d, out);
+	cachesim_level_report(c->l2, out);
+
+	u32 *order = (u32 *)malloc((c->code_size + 1) * sizeof(u32));
+	u32 n = 0;
+	for (u32 i = 0; i <= c->code_size; i++) {
+		if (c->l1_misses[i] != 0) {
+			order[n++] = i;
+		}
+	}
+	qsort_r(order, n, sizeof(u32), cachesim_by_misses, c->l1_misses);
+
+	fprintf(out, "\nmost missing instructions:    L1 misses  memory misses\n");
+	for (u32 i = 0; i < n && i < CACHESIM_TOP_PCS; i++) {
+		u32 idx = order[i];
+		char text[64];
+		disasm(&m->code[idx], text, sizeof(text));
+		fprintf(out, "  %08x  %-28s %12lu %12lu\n", c->code_base + idx * 4, text,
+			c->l1_misses[idx], c->mem_misses[idx]);
+	}
+
+	free(order);
+}
+
+#endif
@@ -47,11 +47,81 @@ typedef struct {
 #define EXECUTABLE 2
 #define PT_LOAD 1
 
+#define PF_X 1
+#define PF_W 2
+#define PF_R 4
+
+// Where asm resolves labels, and so where flat binaries get loaded
+#define FLAT_BASE (0x400000 + sizeof(Elf32_hdr) + sizeof(Program_hdr))
+
 #define EF_MIPS_NOREORDER 0x00000001
 #define EF_MIPS_CPIC      0x00000004
 #define EF_O32            0x00001000
 #define EF_MIPS_ARCH_1    0x10000000
 
+typedef struct Segment {
+	u32 off;
+	u32 vaddr;
+	u32 file_size;
+	u32 mem_size;
+	u32 flags;
+} Segment;
+
+bool is_elf(u8 *bin, u64 size) {
+	return size >= 4 && bin[0] == 0x7F && bin[1] == 'E' && bin[2] == 'L' && bin[3] == 'F';
+}
+
+/*
+ * Collects the PT_LOAD segments of a 32-bit big-endian mips elf image.
+ * Returns the number of segments found, or -1 if the image is malformed.
+ */
+i32 read_elf_segments(u8 *bin, u64 size, Segment *segs, u32 max_segs, u32 *entry) {
+	if (!is_elf(bin, size) || size < sizeof(Elf32_hdr)) {
+		return -1;
+	}
+
+	Elf32_hdr hdr;
+	memcpy(&hdr, bin, sizeof(hdr));
+	if (hdr.bitness != ELFCLASS32 || hdr.endian != ELFDATA2MSB || ntohs(hdr.machine) != MIPS) {
+		return -1;
+	}
+
+	u32 ph_off = ntohl(hdr.program_header_off);
+	u32 ph_size = ntohs(hdr.program_header_entry_size);
+	u32 ph_num = ntohs(hdr.num_program_header_entries);
+	if (ph_size < sizeof(Program_hdr) || (u64)ph_off + (u64)ph_size * ph_num > size) {
+		return -1;
+	}
+
+	u32 num_segs = 0;
+	for (u32 i = 0; i < ph_num; i++) {
+		Program_hdr ph;
+		memcpy(&ph, bin + ph_off + i * ph_size, sizeof(ph));
+		if (ntohl(ph.type) != PT_LOAD) {
+			continue;
+		}
+
+		if (num_segs == max_segs) {
+			return -1;
+		}
+
+		Segment *seg = &segs[num_segs++];
+		seg->off = ntohl(ph.off);
+		seg->vaddr = ntohl(ph.vaddr);
+		seg->file_size = ntohl(ph.file_size);
+		seg->mem_size = ntohl(ph.mem_size);
+		seg->flags = ntohl(ph.flags);
+
+		if ((u64)seg->off + seg->file_size > size || seg->file_size > seg->mem_size ||
+			(u64)seg->vaddr + seg->mem_size > 0x100000000ULL) {
+			return -1;
+		}
+	}
+
+	*entry = ntohl(hdr.program_entry);
+	return num_segs;
+}
+
 void write_elf_file(char *filename, u8 *program, u32 program_size) {
 	FILE *out_file = fopen(filename, "wb");
 
@@ -1,197 +1,352 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <time.h>
 #include <arpa/inet.h>
 
-#include "common.h"
-#include "file.h"
+#include "emulator.h"
 
-void print_reg(u32 *reg) {
-	for (u32 i = 0; i < 32; i++) {
-		printf("r%u: 0x%x\n", i, reg[i]);
+#include "batch.h"
+#include "timeslice.h"
+#include "serve.h"
+
+// Reports and writes out whichever profiles m has, and passes status on
+int profile_done(Machine *m, char *profile_file, char *flame_file, int status) {
+	if (m->profile != NULL) {
+		profile_report(m->profile, m, stderr);
+		if (!profile_write_json(m->profile, m, profile_file)) {
+			return 1;
+		}
+		profile_free(m->profile);
+		m->profile = NULL;
+	}
+
+	if (m->cachesim != NULL) {
+		cachesim_report(m->cachesim, m, stderr);
+	}
+
+	if (m->timing != NULL) {
+		timing_report(m->timing, stderr);
 	}
-}
 
-void syscall_exec(u32 *reg) {
-	u32 syscall_num = reg[2];
-	u32 arg_1 = reg[4]; // a0
-	u32 arg_2 = reg[5]; // a1
-	u32 arg_3 = reg[6]; // a2
-	u32 arg_4 = reg[7]; // a3
-
-	u32 sys_id = syscall_num - 0x4000;
-	switch (sys_id) {
-		case 1: {
-			printf("Running exit\n");
-			exit(arg_1);
-		} break;
-		case 4: {
-			printf("Running write\n");
-			char *msg = "MIPS HELLO\n";
-			write(arg_1, msg, strlen(msg));
-		} break;
-		default: {
-			printf("syscall 0x%x not supported!\n", syscall_num);
-			print_reg(reg);
+	if (m->flame != NULL) {
+		fprintf(stderr, "%lu call stack samples\n", m->flame->samples);
+		if (!flame_write(m->flame, flame_file)) {
+			return 1;
 		}
 	}
+
+	return status;
 }
 
 int main(int argc, char *argv[]) {
-	if (argc != 2) {
-		printf("Invalid number of arguments!\n");
+	bool use_jit = false;
+	bool use_tiered = false;
+	char *cache_dir = NULL;
+	char *trace_file = NULL;
+	char *profile_file = NULL;
+	char *flame_file = NULL;
+	i64 flame_every = 1000;
+	char *sym_file = NULL;
+	char *cache_spec = NULL;
+	char *predictor = NULL;
+	u32 runs = 0;
+	bool snapshot_at = false;
+	u32 snapshot_pc = 0;
+	char *manifest = NULL;
+	char *fuzz_dir = NULL;
+	char *serve_path = NULL;
+	u32 threads = sysconf(_SC_NPROCESSORS_ONLN);
+	i64 slice = 0;
+
+	static struct option long_opts[] = {
+		{"jit", no_argument, NULL, 'j'},
+		{"tiered", no_argument, NULL, 't'},
+		{"cache", required_argument, NULL, 'c'},
+		{"trace", required_argument, NULL, 'T'},
+		{"profile", required_argument, NULL, 'p'},
+		{"flame", required_argument, NULL, 'f'},
+		{"flame-every", required_argument, NULL, 'e'},
+		{"symbols", required_argument, NULL, 'y'},
+		{"cache-model", required_argument, NULL, 'C'},
+		{"timing", required_argument, NULL, 'P'},
+		{"runs", required_argument, NULL, 'r'},
+		{"snapshot-at", required_argument, NULL, 's'},
+		{"batch", required_argument, NULL, 'b'},
+		{"threads", required_argument, NULL, 'n'},
+		{"slice", required_argument, NULL, 'S'},
+		{"fuzz", required_argument, NULL, 'F'},
+		{"serve", required_argument, NULL, 'L'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "jtc:T:p:f:e:y:C:P:r:s:b:n:S:F:L:h", long_opts, NULL)) != -1) {
+		switch (opt) {
+			case 'j': {
+				use_jit = true;
+			} break;
+			case 't': {
+				use_jit = true;
+				use_tiered = true;
+			} break;
+			case 'c': {
+				cache_dir = optarg;
+			} break;
+			case 'T': {
+				trace_file = optarg;
+			} break;
+			case 'p': {
+				profile_file = optarg;
+			} break;
+			case 'f': {
+				flame_file = optarg;
+			} break;
+			case 'e': {
+				flame_every = strtoll(optarg, NULL, 0);
+			} break;
+			case 'y': {
+				sym_file = optarg;
+			} break;
+			case 'C': {
+				cache_spec = optarg;
+			} break;
+			case 'P': {
+				predictor = optarg;
+			} break;
+			case 'r': {
+				runs = strtoul(optarg, NULL, 0);
+			} break;
+			case 's': {
+				snapshot_at = true;
+				snapshot_pc = strtoul(optarg, NULL, 0);
+			} break;
+			case 'b': {
+				manifest = optarg;
+			} break;
+			case 'n': {
+				threads = strtoul(optarg, NULL, 0);
+			} break;
+			case 'S': {
+				slice = strtoll(optarg, NULL, 0);
+				if (slice <= 0) {
+					goto usage;
+				}
+			} break;
+			case 'F': {
+				fuzz_dir = optarg;
+			} break;
+			case 'L': {
+				serve_path = optarg;
+			} break;
+			default: {
+				goto usage;
+			}
+		}
+	}
+
+	if (serve_path != NULL && manifest == NULL && optind == argc && threads > 0) {
+		if (use_tiered || trace_file != NULL || profile_file != NULL || flame_file != NULL || sym_file != NULL ||
+			cache_spec != NULL || predictor != NULL || fuzz_dir != NULL || runs != 0 || snapshot_at || slice != 0) {
+			fprintf(stderr, "--serve runs without --tiered, --fuzz, --runs, --snapshot-at, --slice or any of the instrumented modes\n");
+			goto usage;
+		}
+
+		Serve serve = {0};
+		serve.run = run_fast;
+		serve.use_jit = use_jit;
+		serve.cache_dir = cache_dir;
+
+		run_fast(NULL);
+		fault_init();
+		return run_serve(&serve, serve_path, threads);
+	}
+
+	if (manifest != NULL && serve_path == NULL && optind == argc && threads > 0) {
+		if (use_tiered || trace_file != NULL || profile_file != NULL || flame_file != NULL || sym_file != NULL ||
+			cache_spec != NULL || predictor != NULL || fuzz_dir != NULL || runs != 0 || snapshot_at) {
+			fprintf(stderr, "--batch runs without --tiered, --fuzz, --runs, --snapshot-at or any of the instrumented modes\n");
+			goto usage;
+		}
+
+		Batch batch = {0};
+		batch.run = run_fast;
+		batch.use_jit = use_jit;
+		batch.cache_dir = cache_dir;
+
+		run_fast(NULL);
+		fault_init();
+		if (slice > 0) {
+			return run_sched(&batch, manifest, threads, slice);
+		}
+		return run_batch(&batch, manifest, threads);
+	}
+
+	if (optind != argc - 1 || manifest != NULL || serve_path != NULL || flame_every <= 0) {
+usage:
+		fprintf(stderr, "Usage: %s [--jit | --tiered] [--cache <dir>] [--trace <file>] [--profile <file>]\n"
+				"\t[--flame <file> [--flame-every <n>] [--symbols <file>]] [--cache-model <spec>] [--timing <predictor>]\n"
+				"\t[--runs <n> [--snapshot-at <pc>]] [--fuzz <dir>] <in_file>\n"
+				"       %s --batch <manifest> [--threads <n>] [--slice <n>] [--jit] [--cache <dir>]\n"
+				"       %s --serve <socket> [--threads <n>] [--jit] [--cache <dir>]\n"
+				"\t--jit compiles hot blocks to x86-64\n"
+				"\t--tiered compiles them on a background thread\n"
+				"\t--cache keeps decoded binaries in <dir> between runs\n"
+				"\t--trace writes a binary execution trace, see tracedump\n"
+				"\t--profile counts what the guest runs, reports the hot spots on stderr\n"
+				"\t\tand writes every count to <file> as json\n"
+				"\t--flame samples the guest's call stack every n instructions (default 1000)\n"
+				"\t\tand writes the stacks to <file> folded, for flamegraph.pl\n"
+				"\t--symbols names addresses in them from a map written by asm -m\n"
+				"\t--cache-model runs fetches, loads and stores through simulated caches and reports\n"
+				"\t\ttheir misses; <spec> is \"default\" or e.g. " CACHESIM_DEFAULT "\n"
+				"\t--timing estimates cycles on a 5 stage pipeline with delay slots; the branch\n"
+				"\t\tpredictor is nottaken, taken or bimodal[:<entries>]\n"
+				"\t--runs runs the guest n times, restoring a snapshot in between\n"
+				"\t--snapshot-at takes that snapshot at pc instead of at the entry\n"
+				"\t--fuzz runs the guest on mutations of the inputs in <dir>, keeping those that\n"
+				"\t\treach new edges in <dir>/queue and new crashes in <dir>/crashes; --runs\n"
+				"\t\tstops it after n runs\n"
+				"\t--batch runs every job in the manifest, one \"<binary> [<input>]\" per line,\n"
+				"\t\ton --threads host threads (default: one per core)\n"
+				"\t--slice loads every job up front and switches between them every n instructions\n"
+				"\t--serve runs jobs sent to the Unix socket at <socket> on --threads host threads,\n"
+				"\t\tkeeping machines warm between them; see serve.h\n", argv[0], argv[0], argv[0]);
 		return 1;
 	}
 
-	char *in_file = argv[1];
+	char *in_file = argv[optind];
 
-	File bin_file;
-	if (read_file(in_file, &bin_file) == NULL) {
+	Machine m = {0};
+	if (!load_program(&m, in_file)) {
 		return 1;
 	}
 
-	u8 *bin_8 = (u8 *)bin_file.string;
-	u16 *bin_16 = (u16 *)bin_file.string;
-	u32 *ops = (u32 *)bin_8;
-	u32 num_ops = bin_file.size / 4;
-
-	u32 reg[32] = {0};
-	u32 pc = 0;
-
-	for (; pc < num_ops; pc++) {
-		u32 op = htonl(ops[pc]);
-		debug("Reading %08x\n", op);
-
-		u8 op_id = op >> 26;
-		u8 reg_1 = op << 6 >> 26;
-		u8 reg_2 = op << 11 >> 26;
-		u8 reg_3 = op << 16 >> 26;
-		u8 sa = op << 21 >> 27;
-		u8 special_op_id = op << 26 >> 26;
-		u8 instr_idx = op << 6 >> 6;
-		u16 imm = op << 16 >> 16;
-
-		switch (op_id) {
-			case 0: {
-				switch (special_op_id) {
-					case 0x0: {
-						if (op == 0) {
-							printf("nop\n");
-						} else {
-							printf("sll r%u, r%u, %u\n", reg_3, reg_2, sa);
-							reg[reg_3] = reg[reg_2] << sa;
-						}
-					} break;
-					case 0x8: {
-						printf("jr r%u\n", reg_1);
-
-						pc = reg[reg_1];
-					} break;
-					case 0xc: {
-						printf("syscall\n");
-						syscall_exec(reg);
-					} break;
-					default: {
-						printf("Instruction %x not handled!\n", op);
-						printf("special op id: %u\n", special_op_id);
-						print_reg(reg);
-
-						return 1;
-					}
-				}
-			} break;
-			case 2: {
-				printf("j 0x%x\n", instr_idx);
-				pc = (pc >> 28 << 28) | (instr_idx - 1) >> 2;
-			} break;
-			case 4: {
-				i16 off = imm;
-				printf("beq r%u, r%u, 0x%x\n", reg_1, reg_2, (u16)off);
+	// Instrumented runs need every instruction to go through the interpreter
+	bool hooked = trace_file != NULL || profile_file != NULL || flame_file != NULL ||
+		cache_spec != NULL || predictor != NULL || fuzz_dir != NULL;
+	if (hooked && use_jit) {
+		printf("Instrumented runs go without the jit\n");
+		use_jit = false;
+	}
 
-				if (reg[reg_1] == reg[reg_2]) {
-					pc = (i16)pc + off;
-				}
-			} break;
-			case 5: {
-				i16 off = imm;
-				printf("bne r%u, r%u, 0x%x\n", reg_1, reg_2, off);
+	if (trace_file != NULL) {
+		m.trace = trace_open(trace_file);
+		if (m.trace == NULL) {
+			return 1;
+		}
+	}
 
-				if (reg[reg_1] != reg[reg_2]) {
-					pc = (i16)pc + off;
-				}
-			} break;
-			case 8: {
-				printf("addi r%u, r%u, 0x%x\n", reg_1, reg_2, imm);
+	if (profile_file != NULL) {
+		m.profile = profile_init(&m);
+	}
 
-				reg[reg_2] = reg[reg_1] + imm;
-			} break;
-			case 9: {
-				printf("addiu r%u, r%u, 0x%x\n", reg_2, reg_1, (i16)imm);
+	if (flame_file != NULL) {
+		m.flame = flame_init(m.pc, flame_every);
+		if (sym_file != NULL && !flame_load_symbols(m.flame, sym_file)) {
+			return 1;
+		}
+	}
 
-				reg[reg_2] = reg[reg_1] + imm;
-			} break;
-			case 13: {
-				printf("ori r%u, r%u, 0x%x\n", reg_1, reg_2, imm);
+	if (cache_spec != NULL) {
+		m.cachesim = cachesim_init(&m, cache_spec);
+		if (m.cachesim == NULL) {
+			return 1;
+		}
+	}
 
-				reg[reg_2] = reg[reg_1] | imm;
-			} break;
-			case 15: {
-				u32 load_val = (imm << 16) & 0xFFFF0000;
-				printf("lui r%u, 0x%x\n", reg_2, imm);
+	if (predictor != NULL) {
+		m.timing = timing_init(&m, predictor);
+		if (m.timing == NULL) {
+			return 1;
+		}
+	}
 
-				reg[reg_2] = load_val;
-			} break;
-			case 0x20: {
-				i16 off = imm;
-				printf("lb r%u, [r%u + %u]\n", reg_2, reg_1, off);
+	if (fuzz_dir != NULL && fuzz_init(&m, fuzz_dir) == NULL) {
+		return 1;
+	}
 
-				u32 idx = reg[reg_1] + off;
-				u8 loaded_byte = bin_8[idx];
-				reg[reg_2] = loaded_byte;
-			} break;
-			case 0x23: {
-				i16 off = imm;
-				printf("lw r%u, [r%u + %u]\n", reg_2, reg_1, off);
+	if (use_jit) {
+		m.jit = jit_init();
+		if (m.jit == NULL) {
+			return 1;
+		}
 
-				u32 idx = reg[reg_1] + off;
-				if ((idx % 4) != 0) {
-					printf("Unaligned addressing error: %u\n", idx);
-					return 1;
-				}
+		if (use_tiered && !jit_start_tiered(&m)) {
+			return 1;
+		}
+	}
 
-				u32 word_idx = idx / 4;
-				u32 loaded_word = ops[word_idx];
-				reg[reg_2] = loaded_word;
-			} break;
-			case 0x28: {
-				i16 off = imm;
-				printf("sb r%u, [r%u + %u]\n", reg_2, reg_1, off);
+	int (*run)(Machine *) = run_fast;
+	if (trace_file != NULL) {
+		run = run_hooked;
+	} else if (hooked) {
+		run = run_profiled;
+	}
+	run(NULL);
+	hart_run = run;
+	predecode(&m, cache_dir);
 
-				u32 idx = reg[reg_1] + off;
-				bin_8[idx] = reg[reg_2];
-			} break;
-			case 0x2B: {
-				i16 off = imm;
-				printf("sw r%u, [r%u + %u]\n", reg_2, reg_1, off);
+	fault_init();
 
-				u32 idx = reg[reg_1] + off;
-				if ((idx % 4) != 0) {
-					printf("Unaligned addressing error: %u\n", idx);
-					return 1;
-				}
+	int status = 0;
+	if (runs == 0 && m.fuzz == NULL) {
+		m.spawn_ok = true;
+		status = run_guest(run, &m);
+		return profile_done(&m, profile_file, flame_file, status);
+	}
 
-				u32 word_idx = idx / 4;
-				ops[word_idx] = reg[reg_2];
-			} break;
-			default: {
-				printf("Instruction %x not handled!\n", op);
-				printf("op id: %u\n", op_id);
-				print_reg(reg);
+	if (snapshot_at && !run_until(run, &m, snapshot_pc, &status)) {
+		return profile_done(&m, profile_file, flame_file, status);
+	}
 
+	Snapshot *snap = snapshot_take(&m);
+	if (snap == NULL) {
+		printf("Unable to snapshot the guest!\n");
+		return 1;
+	}
+	// Files the guest has open at the snapshot are open again in every run
+	sys_keep(m.sys);
+
+	if (m.fuzz != NULL) {
+		status = fuzz_main(m.fuzz, &m, run, snap, !snapshot_at, runs);
+		snapshot_free(snap);
+		return status;
+	}
+
+	// The shadow call stack goes back with the rest of the guest
+	FlameStack calls;
+	if (m.flame != NULL) {
+		calls = m.flame->calls;
+	}
+
+	double restore_us = 0;
+	for (u32 i = 0; i < runs; i++) {
+		if (i > 0) {
+			double start = now_us();
+			if (!snapshot_restore(&m, snap)) {
+				printf("Unable to restore the guest!\n");
 				return 1;
 			}
+			sys_reset(m.sys);
+			restore_us += now_us() - start;
+
+			if (m.flame != NULL) {
+				m.flame->calls = calls;
+			}
 		}
+
+		status = run_guest(run, &m);
 	}
+
+	fprintf(stderr, "%u runs, %.2f us per restore\n", runs, runs > 1 ? restore_us / (runs - 1) : 0.0);
+	snapshot_free(snap);
+
+	return profile_done(&m, profile_file, flame_file, status);
 }
@@ -0,0 +1,436 @@
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "loader.h"
+#include "mips.h"
+#include "machine.h"
+#include "syscall.h"
+#include "jit.h"
+#include "tcache.h"
+#include "trace.h"
+#include "profile.h"
+#include "flame.h"
+#include "cachesim.h"
+#include "timing.h"
+#include "fault.h"
+#include "snapshot.h"
+#include "fuzz.h"
+#include "uring.h"
+
+/*
+ * The emulator proper: predecoding, blocks, the interpreters and running
+ * a guest to completion. emu builds its command line on top of this, and
+ * libmipsemu its embedding API (see mipsemu.h).
+ */
+
+// Handler addresses for each Kind and Fuse group, published by run(NULL)
+void **handlers;
+void **fused_handlers;
+
+// Records in m->code hold no handler; it is bound when a block is built
+void decode_at(Machine *m, u32 idx) {
+	u32 pc = m->code_base + idx * 4;
+	decode_op(fetch_op(m->mem, pc), pc, &m->code[idx]);
+}
+
+void blocks_init(Machine *m);
+
+// Returns true if the records were mapped from the cache, for tcache_unmap rather than free
+bool predecode(Machine *m, char *cache_dir) {
+	u64 hash = 0;
+	if (cache_dir != NULL) {
+		hash = hash_bytes(m->file, m->file_size);
+		m->code = tcache_load(cache_dir, hash, m->file_size, m->code_base, m->code_size + 1);
+	}
+
+	bool cached = m->code != NULL;
+	if (!cached) {
+		m->code = (Decoded *)calloc(m->code_size + 1, sizeof(Decoded));
+
+		for (u32 i = 0; i < m->code_size; i++) {
+			decode_at(m, i);
+		}
+
+		// Falling off the end of the text lands on this sentinel
+		m->code[m->code_size].kind = Kind_End;
+
+		if (cache_dir != NULL) {
+			tcache_store(cache_dir, hash, m->file_size, m->code_base, m->code, m->code_size + 1);
+		}
+	}
+
+	blocks_init(m);
+	return cached;
+}
+
+void blocks_init(Machine *m) {
+	m->blocks = (Block **)calloc(m->code_size + 1, sizeof(Block *));
+	m->in_block = (u8 *)calloc(m->code_size + 1, sizeof(u8));
+}
+
+void blocks_free(Machine *m) {
+	while (m->block_list != NULL) {
+		Block *b = m->block_list;
+		m->block_list = b->next;
+		jit_forget(m, b);
+		free(b);
+	}
+
+	free(m->blocks);
+	free(m->in_block);
+}
+
+// Gives m its own copy of text it shares with other machines, before a write
+void code_own(Machine *m) {
+	if (!m->code_shared) {
+		return;
+	}
+
+	Decoded *code = (Decoded *)malloc((m->code_size + 1) * sizeof(Decoded));
+	memcpy(code, m->code, (m->code_size + 1) * sizeof(Decoded));
+	m->code = code;
+	m->code_shared = false;
+}
+
+// The superinstruction ops starts, if any, and how many ops it covers
+u8 fuse_match(Decoded *ops, u32 left, u32 *width) {
+	u8 k0 = ops[0].kind;
+	u8 k1 = left > 1 ? ops[1].kind : Kind_Illegal;
+	u8 k2 = left > 2 ? ops[2].kind : Kind_Illegal;
+
+	*width = 3;
+	if (k0 == Kind_Addiu && k1 == Kind_Addiu && k2 == Kind_Bne) return Fuse_AddiuAddiuBne;
+
+	*width = 2;
+	if (k0 == Kind_Lui && k1 == Kind_Ori) return Fuse_LuiOri;
+	if (k0 == Kind_Addiu && k1 == Kind_Bne) return Fuse_AddiuBne;
+	if (k0 == Kind_Addiu && k1 == Kind_Beq) return Fuse_AddiuBeq;
+	if (k0 == Kind_Addiu && k1 == Kind_Addiu) return Fuse_AddiuAddiu;
+
+	*width = 1;
+	return Fuse_None;
+}
+
+// Binds the first op of every group in b to its superinstruction, left to right
+void block_fuse(Block *b) {
+	for (u32 i = 0; i < b->len;) {
+		u32 width;
+		u8 fuse = fuse_match(&b->ops[i], b->len - i, &width);
+		if (fuse != Fuse_None) {
+			b->ops[i].handler = fused_handlers[fuse];
+		}
+		i += width;
+	}
+}
+
+Block *block_build(Machine *m, u32 idx) {
+	u32 len = 0;
+	while (len < BLOCK_MAX_OPS) {
+		u8 kind = m->code[idx + len].kind;
+		len++;
+
+		if (ends_block(kind)) {
+			break;
+		}
+	}
+
+	// Runs cut short by BLOCK_MAX_OPS get a Chain op to carry on
+	bool needs_chain = !ends_block(m->code[idx + len - 1].kind);
+
+	Block *b = (Block *)calloc(1, sizeof(Block) + (len + needs_chain) * sizeof(Decoded));
+	b->pc = m->code_base + idx * 4;
+	b->len = len;
+	memcpy(b->ops, m->code + idx, len * sizeof(Decoded));
+
+	if (needs_chain) {
+		b->ops[len].kind = Kind_Chain;
+	}
+
+	for (u32 i = 0; i < len + needs_chain; i++) {
+		b->ops[i].handler = handlers[b->ops[i].kind];
+	}
+	block_fuse(b);
+
+	for (u32 i = 0; i < len && idx + i < m->code_size; i++) {
+		m->in_block[idx + i] = 1;
+	}
+
+	b->next = m->block_list;
+	m->block_list = b;
+	m->blocks[idx] = b;
+
+	return b;
+}
+
+Block *block_lookup(Machine *m, u32 pc) {
+	u32 idx = (pc - m->code_base) / 4;
+	if ((pc & 3) || !in_code(m, pc)) {
+		return NULL;
+	}
+
+	Block *b = m->blocks[idx];
+	if (b == NULL) {
+		b = block_build(m, idx);
+	}
+
+	return b;
+}
+
+/*
+ * Called after a guest store lands inside the image. Re-decodes the words
+ * it touched and drops every block covering them, along with any links
+ * into those blocks. Returns true if cur was one of the dropped blocks.
+ */
+bool code_written(Machine *m, u32 addr, u32 width, Block *cur) {
+	u32 first = (addr - m->code_base) / 4;
+	u32 last = (addr + width - 1 - m->code_base) / 4;
+	if (last >= m->code_size) {
+		last = m->code_size - 1;
+	}
+
+	code_own(m);
+
+	bool hit = false;
+	for (u32 i = first; i <= last; i++) {
+		decode_at(m, i);
+		hit |= m->in_block[i];
+	}
+
+	m->code_writes++;
+
+	if (!hit) {
+		return false;
+	}
+
+	u32 lo = m->code_base + first * 4;
+	u32 hi = m->code_base + last * 4;
+
+	// Keeps the compiler thread off blocks while they are unlinked and freed
+	jit_lock(m);
+
+	Block *dead = NULL;
+	Block **link = &m->block_list;
+	while (*link != NULL) {
+		Block *b = *link;
+		if (b->pc <= hi && lo < b->pc + b->len * 4) {
+			*link = b->next;
+			m->blocks[(b->pc - m->code_base) / 4] = NULL;
+			b->next = dead;
+			dead = b;
+		} else {
+			link = &b->next;
+		}
+	}
+
+	bool cur_dead = false;
+	for (Block *b = dead; b != NULL; b = b->next) {
+		cur_dead |= (b == cur);
+	}
+
+	for (Block *b = m->block_list; b != NULL; b = b->next) {
+		for (Block *d = dead; d != NULL; d = d->next) {
+			if (b->taken == d) b->taken = NULL;
+			if (b->fall == d) b->fall = NULL;
+		}
+	}
+
+	while (dead != NULL) {
+		Block *next = dead->next;
+		jit_forget(m, dead);
+		free(dead);
+		dead = next;
+	}
+
+	jit_unlock(m);
+
+	return cur_dead;
+}
+
+// Re-decodes all of the text and drops every block, for when guest memory
+// is swapped out from under them
+void code_reset(Machine *m) {
+	code_own(m);
+	for (u32 i = 0; i < m->code_size; i++) {
+		decode_at(m, i);
+	}
+
+	jit_lock(m);
+
+	while (m->block_list != NULL) {
+		Block *b = m->block_list;
+		m->block_list = b->next;
+		jit_forget(m, b);
+		free(b);
+	}
+
+	memset(m->blocks, 0, (m->code_size + 1) * sizeof(Block *));
+	memset(m->in_block, 0, m->code_size + 1);
+
+	jit_unlock(m);
+}
+
+#define INTERP_NAME run_fast
+#define INTERP_HOOKS 0
+#define INTERP_PROFILE 0
+#include "interp.h"
+
+#define INTERP_NAME run_profiled
+#define INTERP_HOOKS 0
+#define INTERP_PROFILE 1
+#include "interp.h"
+
+#define INTERP_NAME run_hooked
+#define INTERP_HOOKS 1
+#define INTERP_PROFILE 1
+#include "interp.h"
+
+// Runs the guest until it exits, turning guest faults into a status of 1
+int run_guest(int (*run)(Machine *), Machine *m) {
+	sigjmp_buf env;
+	int status = 1;
+	if (sigsetjmp(env, 1)) {
+		m->stop = Stop_Fault;
+	} else {
+		fault_machine = m;
+		fault_env = &env;
+		status = run(m);
+	}
+	fault_env = NULL;
+
+	// Whatever the guest wrote goes out once it's done, however it ended
+	if (m->stop == Stop_Exit || m->stop == Stop_Fault) {
+		sys_flush(m->sys);
+	}
+	if (m->stop == Stop_Fault) {
+		if (!m->quiet) {
+			fault_report(m);
+		}
+		return 1;
+	}
+	return status;
+}
+
+/*
+ * Runs the guest for about budget instructions and returns how many it
+ * ran. The budget is taken a block at a time, so the last block can take
+ * the run a few instructions past it.
+ */
+u64 run_budget(int (*run)(Machine *), Machine *m, i64 budget, int *status) {
+	m->budget = budget;
+	*status = run_guest(run, m);
+
+	i64 ran = budget - m->budget;
+	return ran > 0 ? ran : 0;
+}
+
+static u32 num_harts = 1;
+
+// Whichever interpreter handlers[] was published by
+static int (*hart_run)(Machine *);
+
+void *hart_main(void *arg) {
+	Machine *h = (Machine *)arg;
+	run_guest(hart_run, h);
+
+	// A fault takes the whole program down, as it would on hardware
+	if (h->stop == Stop_Fault) {
+		exit(1);
+	}
+
+	blocks_free(h);
+	if (!h->code_shared) {
+		free(h->code);
+	}
+	if (h->jit != NULL) {
+		jit_free(h->jit);
+	}
+	free(h);
+
+	return NULL;
+}
+
+/*
+ * Starts another hart at pc on its own host thread, with sp and a0 set
+ * from the caller. It shares guest memory and the decoded text with m,
+ * but has its own registers and blocks. Once there are two harts no one
+ * re-decodes the shared text in place: a hart that rewrites text takes
+ * its own copy first (code_own), so the others never see records change
+ * under them, and don't see the new code either. A hart stops when it exits, and the
+ * program ends when the first hart exits. Returns the new hart's id, or
+ * -1 if m can't spawn.
+ */
+u32 hart_spawn(Machine *m, u32 pc, u32 sp, u32 arg) {
+	if (!m->spawn_ok) {
+		return -1;
+	}
+
+	Machine *h = (Machine *)calloc(1, sizeof(Machine));
+	h->mem = m->mem;
+	h->mem_size = m->mem_size;
+	h->file = m->file;
+	h->file_size = m->file_size;
+	h->code = m->code;
+	h->code_shared = true;
+	// m's copy is now read by h's thread too; it's left to the process
+	// exit to free, as m may have moved on to a copy of its own
+	m->code_shared = true;
+	h->code_base = m->code_base;
+	h->code_size = m->code_size;
+	h->stack_low = m->stack_low;
+	h->sys = m->sys;
+
+	h->pc = pc;
+	h->reg[29] = sp;
+	h->reg[4] = arg;
+	h->budget = BUDGET_UNLIMITED;
+	h->spawn_ok = true;
+	h->hart_id = __atomic_fetch_add(&num_harts, 1, __ATOMIC_RELAXED);
+
+	blocks_init(h);
+	if (m->jit != NULL) {
+		h->jit = jit_init();
+	}
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, hart_main, h) != 0) {
+		blocks_free(h);
+		free(h);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return h->hart_id;
+}
+
+/*
+ * Runs the guest up to pc and leaves it stopped there, by making pc the
+ * end of the text until it is reached. Returns false if it exited first.
+ */
+bool run_until(int (*run)(Machine *), Machine *m, u32 pc, int *status) {
+	if ((pc & 3) || !in_code(m, pc)) {
+		printf("0x%x is not in the text!\n", pc);
+		*status = 1;
+		return false;
+	}
+
+	m->code[(pc - m->code_base) / 4].kind = Kind_End;
+	*status = run_guest(run, m);
+	code_written(m, pc, 4, NULL);
+
+	return m->pc == pc;
+}
+
+double now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+#endif
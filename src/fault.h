@@ -0,0 +1,97 @@
+#ifndef FAULT_H
+#define FAULT_H
+
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "loader.h"
+#include "machine.h"
+
+/*
+ * Guest memory faults. Guest loads and stores go straight to m->mem +
+ * addr, so an access to an unmapped guest page lands here as a host
+ * SIGSEGV. Faults in the stack range commit the page and retry; anything
+ * else in the guest space jumps back to whoever armed fault_env, which
+ * reports it as a guest fault. fault_env and fault_machine are per host
+ * thread, so each thread running a guest catches its own faults. Host
+ * faults are handed on untouched to the handler that was installed
+ * before (the tracer's, or the default).
+ *
+ * Unaligned accesses and unknown instructions are guest faults too, but
+ * no signal comes with them: the interpreter stops with Stop_Fault and
+ * sets fault_addr and fault_kind itself.
+ */
+
+enum {
+	Fault_Access,
+	// fault_addr is the unaligned address
+	Fault_Unaligned,
+	// fault_addr is the instruction's pc
+	Fault_Illegal,
+};
+
+static __thread sigjmp_buf *fault_env;
+static __thread u32 fault_addr;
+static __thread u32 fault_kind;
+
+static __thread Machine *fault_machine;
+static struct sigaction fault_old_segv;
+static struct sigaction fault_old_bus;
+
+void fault_handler(int sig, siginfo_t *info, void *ctx) {
+	(void)ctx;
+	Machine *m = fault_machine;
+	u8 *host = (u8 *)info->si_addr;
+
+	if (fault_env != NULL && host >= m->mem && host < m->mem + GUEST_SPACE) {
+		u32 addr = host - m->mem;
+		u32 page_addr = addr & ~(getpagesize() - 1);
+
+		if (sig == SIGSEGV && addr < STACK_TOP && addr >= STACK_TOP - STACK_MAX &&
+			mprotect(m->mem + page_addr, getpagesize(), PROT_READ | PROT_WRITE) == 0) {
+			if (page_addr < m->stack_low) {
+				m->stack_low = page_addr;
+			}
+			return;
+		}
+
+		fault_addr = addr;
+		fault_kind = Fault_Access;
+		siglongjmp(*fault_env, 1);
+	}
+
+	// Not ours: put back the old handler and let the access fault again
+	sigaction(sig, sig == SIGSEGV ? &fault_old_segv : &fault_old_bus, NULL);
+}
+
+// Says what the last fault on this thread was, and where the guest was
+void fault_report(Machine *m) {
+	switch (fault_kind) {
+		case Fault_Access: {
+			printf("Segmentation fault at 0x%x\n", fault_addr);
+		} break;
+		case Fault_Unaligned: {
+			printf("Unaligned addressing error at 0x%x\n", fault_addr);
+		} break;
+		case Fault_Illegal: {
+			u32 op;
+			memcpy(&op, m->mem + fault_addr, sizeof(op));
+			printf("Instruction %x at 0x%x not handled!\n", op, fault_addr);
+		} break;
+	}
+	print_reg(m->reg);
+}
+
+void fault_init() {
+	struct sigaction sa = {0};
+	sa.sa_sigaction = fault_handler;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+
+	sigaction(SIGSEGV, &sa, &fault_old_segv);
+	sigaction(SIGBUS, &sa, &fault_old_bus);
+}
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef FLAME_H
+#define FLAME_H
+
+#include "common.h"
+#include "map.h"
+#include "machine.h"
+
+/*
+ * Call-graph sampling, for flamegraphs. The interpreter's profiling hooks
+ * keep a shadow call stack: jal pushes its target and return address,
+ * and a jr to a return address on the stack pops back down to it (so a
+ * jr to anything else, like a jump table, leaves the stack alone). Every
+ * period instructions, counted a block at a time, the stack is sampled.
+ * At exit every distinct stack is written out in the folded format
+ * flamegraph.pl and speedscope read, "main;foo;bar <samples>", with
+ * addresses named from an asm symbol map (asm -m) when there is one.
+ */
+
+#define FLAME_MAX_DEPTH 256
+
+typedef struct Frame {
+	u32 func;
+	u32 ret;
+} Frame;
+
+typedef struct FlameStack {
+	Frame frames[FLAME_MAX_DEPTH];
+	u32 depth;
+	// Calls made past FLAME_MAX_DEPTH, which aren't on the stack
+	u32 lost;
+} FlameStack;
+
+typedef struct Sym {
+	u32 addr;
+	char *name;
+} Sym;
+
+typedef struct Flame {
+	i64 period;
+	i64 countdown;
+	FlameStack calls;
+
+	// Folded stack of hex addresses -> u64 *samples
+	Map *stacks;
+	u64 samples;
+
+	Sym *syms;
+	u32 num_syms;
+} Flame;
+
+Flame *flame_init(u32 entry, i64 period) {
+	Flame *f = (Flame *)calloc(1, sizeof(Flame));
+	f->period = period;
+	f->countdown = period;
+	f->calls.frames[0].func = entry;
+	f->calls.depth = 1;
+	f->stacks = map_init();
+	return f;
+}
+
+static inline void flame_call(Flame *f, u32 func, u32 ret) {
+	if (f->calls.depth == FLAME_MAX_DEPTH) {
+		f->calls.lost++;
+		return;
+	}
+
+	f->calls.frames[f->calls.depth].func = func;
+	f->calls.frames[f->calls.depth].ret = ret;
+	f->calls.depth++;
+}
+
+static inline void flame_return(Flame *f, u32 target) {
+	if (f->calls.lost > 0) {
+		f->calls.lost--;
+		return;
+	}
+
+	for (u32 i = f->calls.depth - 1; i > 0; i--) {
+		if (f->calls.frames[i].ret == target) {
+			f->calls.depth = i;
+			return;
+		}
+	}
+}
+
+void flame_sample(Flame *f) {
+	f->countdown += f->period;
+	f->samples++;
+
+	char key[FLAME_MAX_DEPTH * 9 + 1];
+	u32 len = 0;
+	for (u32 i = 0; i < f->calls.depth; i++) {
+		len += sprintf(key + len, i == 0 ? "%x" : ";%x", f->calls.frames[i].func);
+	}
+
+	Bucket b = map_get(f->stacks, key);
+	if (b.key == NULL) {
+		u64 *count = (u64 *)calloc(1, sizeof(u64));
+		map_insert(f->stacks, strdup(key), count);
+		b.data = count;
+	}
+	(*(u64 *)b.data)++;
+}
+
+static int sym_by_addr(const void *a, const void *b) {
+	u32 x = ((Sym *)a)->addr;
+	u32 y = ((Sym *)b)->addr;
+	return (x > y) - (x < y);
+}
+
+// Reads a map of "<hex address> <name>" lines, as written by asm -m
+bool flame_load_symbols(Flame *f, char *path) {
+	FILE *in = fopen(path, "r");
+	if (in == NULL) {
+		printf("%s not found!\n", path);
+		return false;
+	}
+
+	u32 cap = 64;
+	f->syms = (Sym *)malloc(cap * sizeof(Sym));
+
+	char line[512];
+	while (fgets(line, sizeof(line), in) != NULL) {
+		u32 addr;
+		char name[256];
+		if (sscanf(line, "%x %255s", &addr, name) != 2) {
+			continue;
+		}
+
+		if (f->num_syms == cap) {
+			cap *= 2;
+			f->syms = (Sym *)realloc(f->syms, cap * sizeof(Sym));
+		}
+		f->syms[f->num_syms].addr = addr;
+		f->syms[f->num_syms].name = strdup(name);
+		f->num_syms++;
+	}
+
+	fclose(in);
+	qsort(f->syms, f->num_syms, sizeof(Sym), sym_by_addr);
+	return true;
+}
+
+// The symbol at or below addr, as "name" or "name+0x10"; a bare address without one
+static void flame_name(Flame *f, u32 addr, char *buf, u32 size) {
+	Sym *best = NULL;
+	u32 lo = 0;
+	u32 hi = f->num_syms;
+	while (lo < hi) {
+		u32 mid = (lo + hi) / 2;
+		if (f->syms[mid].addr <= addr) {
+			best = &f->syms[mid];
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (best == NULL) {
+		snprintf(buf, size, "0x%x", addr);
+	} else if (best->addr == addr) {
+		snprintf(buf, size, "%s", best->name);
+	} else {
+		snprintf(buf, size, "%s+0x%x", best->name, addr - best->addr);
+	}
+}
+
+bool flame_write(Flame *f, char *path) {
+	FILE *out = fopen(path, "w");
+	if (out == NULL) {
+		printf("Unable to open flamegraph file %s!\n", path);
+		return false;
+	}
+
+	for (u32 i = 0; i < f->stacks->capacity; i++) {
+		Bucket b = f->stacks->m[i];
+		if (b.key == NULL) {
+			continue;
+		}
+
+		char *save;
+		char *key = strdup(b.key);
+		char *frame = strtok_r(key, ";", &save);
+		for (bool first = true; frame != NULL; first = false) {
+			char name[300];
+			flame_name(f, strtoul(frame, NULL, 16), name, sizeof(name));
+			fprintf(out, "%s%s", first ? "" : ";", name);
+			frame = strtok_r(NULL, ";", &save);
+		}
+		fprintf(out, " %lu\n", *(u64 *)b.data);
+		free(key);
+	}
+
+	fclose(out);
+	return true;
+}
+
+#endif
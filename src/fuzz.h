@@ -0,0 +1,472 @@
+#ifndef FUZZ_H
+#define FUZZ_H
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "machine.h"
+#include "loader.h"
+#include "snapshot.h"
+#include "syscall.h"
+
+/*
+ * Coverage-guided fuzzing, in process. The guest runs over and over from
+ * one snapshot, each time on an input mutated from the queue, and inputs
+ * that reach new coverage join the queue.
+ *
+ * Coverage is edges between blocks, so across every beq, bne, j and jr
+ * the guest takes, recorded by the profiling hooks into a 64 KiB map laid
+ * out the way AFL's is: each block gets a hashed id from its pc, an edge
+ * bumps map[cur ^ prev] and prev becomes cur >> 1. Counts are bucketed
+ * like AFL's too, so taking an edge 4 times instead of 3 is new. With
+ * __AFL_SHM_ID set the map is that shared memory segment.
+ *
+ * An input is copied to INPUT_BASE (up to FUZZ_MAX_INPUT bytes), with a0
+ * and a1 set to its address and length when the snapshot is at the
+ * entry, and is also what the guest reads from fd 0. Resetting between
+ * runs copies back only the pages the guest wrote, which the store hooks
+ * and reads keep a list of; a run that calls brk, mmap or munmap gets a
+ * whole snapshot_restore instead. Runs that fault are crashes and runs
+ * that go FUZZ_BUDGET instructions are hangs.
+ *
+ * Seeds are the files in the fuzz directory; new inputs go to its queue/
+ * directory and crashes with new coverage to crashes/.
+ */
+
+#define FUZZ_MAP_SIZE (1 << 16)
+#define FUZZ_MAX_INPUT (1 << 20)
+#define FUZZ_BUDGET 10000000
+// Stack committed before the snapshot, so runs don't each fault it in again
+#define FUZZ_STACK (64 * 1024)
+// Mutants run per pick from the queue
+#define FUZZ_HAVOC 256
+
+typedef struct FuzzInput {
+	u8 *data;
+	u32 len;
+} FuzzInput;
+
+typedef struct Fuzz {
+	u8 *map;
+	u32 prev;
+	// Buckets not seen yet for each edge, for all runs and for crashing ones
+	u8 virgin[FUZZ_MAP_SIZE];
+	u8 virgin_crash[FUZZ_MAP_SIZE];
+	u8 buckets[256];
+
+	// Guest pages written since the last reset, and whether the heap moved
+	u32 page_shift;
+	u8 *dirty_map;
+	u32 *dirty;
+	u32 num_dirty;
+	u32 cap_dirty;
+	bool heap_dirty;
+	// The syscall being run, noted before it overwrites v0
+	u32 syscall;
+
+	FuzzInput *queue;
+	u32 num_queue;
+	u32 cap_queue;
+	u8 *buf;
+	u32 len;
+	u64 rng;
+
+	char *dir;
+	u64 execs;
+	u64 crashes;
+	u64 hangs;
+	u32 edges;
+} Fuzz;
+
+static inline void fuzz_edge(Fuzz *f, u32 pc) {
+	u32 cur = ((pc >> 2) * 0x9E3779B1) >> 16;
+	f->map[cur ^ f->prev]++;
+	f->prev = cur >> 1;
+}
+
+static inline void fuzz_dirty(Fuzz *f, u32 addr) {
+	u32 page = addr >> f->page_shift;
+	if (f->dirty_map[page]) {
+		return;
+	}
+
+	if (f->num_dirty == f->cap_dirty) {
+		f->cap_dirty *= 2;
+		f->dirty = (u32 *)realloc(f->dirty, f->cap_dirty * sizeof(u32));
+	}
+	f->dirty_map[page] = 1;
+	f->dirty[f->num_dirty++] = page << f->page_shift;
+}
+
+static void fuzz_dirty_range(Fuzz *f, u32 addr, u32 len) {
+	u32 page = 1 << f->page_shift;
+	for (u64 a = addr & ~(page - 1); a < (u64)addr + len; a += page) {
+		fuzz_dirty(f, a);
+	}
+}
+
+// After f->syscall: notes what it wrote to guest memory
+static inline void fuzz_syscall(Fuzz *f, u32 *reg) {
+	u32 sys_id = f->syscall >= 0x4000 ? f->syscall - 0x4000 : f->syscall - 4000;
+	if (sys_id == 3 && reg[7] == 0) {
+		fuzz_dirty_range(f, reg[5], reg[2]);
+	} else if (sys_id == 45 || sys_id == 90 || sys_id == 91) {
+		f->heap_dirty = true;
+	}
+}
+
+static void fuzz_queue_add(Fuzz *f) {
+	if (f->num_queue == f->cap_queue) {
+		f->cap_queue = f->cap_queue ? f->cap_queue * 2 : 64;
+		f->queue = (FuzzInput *)realloc(f->queue, f->cap_queue * sizeof(FuzzInput));
+	}
+
+	FuzzInput *in = &f->queue[f->num_queue++];
+	in->data = (u8 *)malloc(f->len ? f->len : 1);
+	memcpy(in->data, f->buf, f->len);
+	in->len = f->len;
+}
+
+Fuzz *fuzz_init(Machine *m, char *dir) {
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		printf("%s not found!\n", dir);
+		return NULL;
+	}
+
+	if (!add_region(m, INPUT_BASE, INPUT_BASE + FUZZ_MAX_INPUT) ||
+		mprotect(m->mem + INPUT_BASE, FUZZ_MAX_INPUT, PROT_READ | PROT_WRITE) != 0) {
+		printf("Unable to map the fuzz input!\n");
+		closedir(d);
+		return NULL;
+	}
+
+	if (m->stack_low > STACK_TOP - FUZZ_STACK &&
+		mprotect(m->mem + STACK_TOP - FUZZ_STACK, FUZZ_STACK, PROT_READ | PROT_WRITE) == 0) {
+		m->stack_low = STACK_TOP - FUZZ_STACK;
+	}
+
+	Fuzz *f = (Fuzz *)calloc(1, sizeof(Fuzz));
+	f->dir = dir;
+	f->rng = 0x2545F4914F6CDD1D ^ (u64)time(NULL);
+
+	char *shm = getenv("__AFL_SHM_ID");
+	if (shm != NULL) {
+		f->map = (u8 *)shmat(atoi(shm), NULL, 0);
+		if (f->map == (u8 *)-1) {
+			printf("Unable to attach the AFL map %s!\n", shm);
+			return NULL;
+		}
+	} else {
+		f->map = (u8 *)calloc(FUZZ_MAP_SIZE, 1);
+	}
+	memset(f->map, 0, FUZZ_MAP_SIZE);
+	memset(f->virgin, 0xFF, FUZZ_MAP_SIZE);
+	memset(f->virgin_crash, 0xFF, FUZZ_MAP_SIZE);
+
+	// AFL's hit count buckets: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+
+	for (u32 i = 1; i < 256; i++) {
+		f->buckets[i] = i <= 2 ? i : i == 3 ? 4 : i < 8 ? 8 : i < 16 ? 16 : i < 32 ? 32 : i < 128 ? 64 : 128;
+	}
+
+	f->page_shift = __builtin_ctz(getpagesize());
+	f->dirty_map = (u8 *)calloc(GUEST_SPACE >> f->page_shift, 1);
+	f->cap_dirty = 256;
+	f->dirty = (u32 *)malloc(f->cap_dirty * sizeof(u32));
+	f->buf = (u8 *)malloc(FUZZ_MAX_INPUT);
+
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		struct stat st;
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+
+		FILE *in = fopen(path, "rb");
+		if (in == NULL) {
+			continue;
+		}
+		f->len = fread(f->buf, 1, FUZZ_MAX_INPUT, in);
+		fclose(in);
+		fuzz_queue_add(f);
+	}
+	closedir(d);
+
+	if (f->num_queue == 0) {
+		f->buf[0] = 0;
+		f->len = 1;
+		fuzz_queue_add(f);
+	}
+
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/queue", dir);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/crashes", dir);
+	mkdir(path, 0755);
+
+	m->fuzz = f;
+	return f;
+}
+
+static void fuzz_save(Fuzz *f, char *sub, u64 id) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s/id_%06lu", f->dir, sub, id);
+	FILE *out = fopen(path, "wb");
+	if (out != NULL) {
+		fwrite(f->buf, 1, f->len, out);
+		fclose(out);
+	}
+}
+
+/*
+ * Buckets the counts in the map, clearing it as it goes, and takes them
+ * out of virgin. Returns 2 if an edge was hit for the first time, 1 if
+ * only a count landed in a new bucket, 0 otherwise.
+ */
+static u32 fuzz_novel(Fuzz *f, u8 *virgin) {
+	u64 *words = (u64 *)f->map;
+	u32 novel = 0;
+	// The map is mostly zero, so it's checked a cache line at a time
+	for (u32 line = 0; line < FUZZ_MAP_SIZE / 8; line += 8) {
+		u64 any = 0;
+		for (u32 i = line; i < line + 8; i++) {
+			any |= words[i];
+		}
+		if (any == 0) {
+			continue;
+		}
+
+		u8 *counts = (u8 *)&words[line];
+		for (u32 j = 0; j < 64; j++) {
+			if (counts[j] == 0) {
+				continue;
+			}
+
+			u8 bucket = f->buckets[counts[j]];
+			u8 *v = &virgin[line * 8 + j];
+			if (bucket & *v) {
+				if (*v == 0xFF) {
+					novel = 2;
+				} else if (novel == 0) {
+					novel = 1;
+				}
+				*v &= ~bucket;
+			}
+			counts[j] = 0;
+		}
+	}
+	return novel;
+}
+
+static u64 fuzz_rand(Fuzz *f) {
+	f->rng ^= f->rng << 13;
+	f->rng ^= f->rng >> 7;
+	f->rng ^= f->rng << 17;
+	return f->rng;
+}
+
+static u32 fuzz_below(Fuzz *f, u32 n) {
+	return n ? fuzz_rand(f) % n : 0;
+}
+
+static const i32 fuzz_interesting[] = {
+	-128, -1, 0, 1, 16, 32, 64, 100, 127,
+	-32768, -129, 128, 255, 256, 512, 1000, 1024, 4096, 32767,
+	INT32_MIN, -100663046, -32769, 32768, 65535, 65536, 100663045, INT32_MAX,
+};
+
+// Stacks up a few AFL havoc style changes to f->buf
+static void fuzz_mutate(Fuzz *f) {
+	u32 count = 1 << (1 + fuzz_below(f, 5));
+	for (u32 n = 0; n < count; n++) {
+		u32 len = f->len;
+		switch (fuzz_below(f, len == 0 ? 1 : 10)) {
+			case 0: {
+				// Insert a run of one random byte, or of bytes from elsewhere in the input
+				u32 size = 1 + fuzz_below(f, len < 32 ? 32 : len / 2);
+				if (len + size > FUZZ_MAX_INPUT) {
+					break;
+				}
+				u32 at = fuzz_below(f, len + 1);
+				memmove(f->buf + at + size, f->buf + at, len - at);
+				if (len > size && fuzz_below(f, 2)) {
+					u32 from = fuzz_below(f, len - size + 1);
+					memmove(f->buf + at, f->buf + (from < at ? from : from + size), size);
+				} else {
+					memset(f->buf + at, fuzz_rand(f), size);
+				}
+				f->len += size;
+			} break;
+			case 1: {
+				f->buf[fuzz_below(f, len)] ^= 1 << fuzz_below(f, 8);
+			} break;
+			case 2: {
+				f->buf[fuzz_below(f, len)] = fuzz_rand(f);
+			} break;
+			case 3: {
+				f->buf[fuzz_below(f, len)] = fuzz_interesting[fuzz_below(f, 9)];
+			} break;
+			case 4: {
+				i32 delta = 1 + fuzz_below(f, 35);
+				f->buf[fuzz_below(f, len)] += fuzz_below(f, 2) ? delta : -delta;
+			} break;
+			case 5: case 6: {
+				// A 16 or 32 bit interesting value, either way round
+				u32 size = fuzz_below(f, 2) ? 2 : 4;
+				if (len < size) {
+					break;
+				}
+				u32 value = fuzz_interesting[fuzz_below(f, size == 2 ? 19 : 27)];
+				u32 at = fuzz_below(f, len - size + 1);
+				bool big = fuzz_below(f, 2);
+				for (u32 i = 0; i < size; i++) {
+					f->buf[at + i] = value >> (8 * (big ? size - 1 - i : i));
+				}
+			} break;
+			case 7: {
+				// Delete a block, keeping at least a byte
+				if (len < 2) {
+					break;
+				}
+				u32 size = 1 + fuzz_below(f, len - 1);
+				u32 at = fuzz_below(f, len - size + 1);
+				memmove(f->buf + at, f->buf + at + size, len - at - size);
+				f->len -= size;
+			} break;
+			case 8: {
+				// Overwrite a block with another part of the input
+				u32 size = 1 + fuzz_below(f, len);
+				memmove(f->buf + fuzz_below(f, len - size + 1), f->buf + fuzz_below(f, len - size + 1), size);
+			} break;
+			case 9: {
+				// Splice in part of another queue entry
+				FuzzInput *other = &f->queue[fuzz_below(f, f->num_queue)];
+				u32 size = other->len < len ? other->len : len;
+				if (size == 0) {
+					break;
+				}
+				size = 1 + fuzz_below(f, size);
+				memcpy(f->buf + fuzz_below(f, len - size + 1), other->data + fuzz_below(f, other->len - size + 1), size);
+			} break;
+		}
+	}
+}
+
+// Puts the guest back as it was at the snapshot, with f->buf as its input
+static bool fuzz_reset(Fuzz *f, Machine *m, Snapshot *snap, bool set_args) {
+	bool ok;
+	if (f->heap_dirty) {
+		ok = snapshot_restore(m, snap);
+	} else {
+		ok = snapshot_restore_pages(m, snap, f->dirty, f->num_dirty);
+	}
+	for (u32 i = 0; i < f->num_dirty; i++) {
+		f->dirty_map[f->dirty[i] >> f->page_shift] = 0;
+	}
+	f->num_dirty = 0;
+	f->heap_dirty = false;
+
+	// Files the last run opened are closed, and what it wrote is dropped
+	sys_reset(m->sys);
+
+	memcpy(m->mem + INPUT_BASE, f->buf, f->len);
+	fuzz_dirty_range(f, INPUT_BASE, f->len);
+	if (set_args) {
+		m->reg[4] = INPUT_BASE;
+		m->reg[5] = f->len;
+	}
+
+	m->sys->input = f->buf;
+	m->sys->input_len = f->len;
+	m->budget = FUZZ_BUDGET;
+	f->prev = 0;
+	return ok;
+}
+
+static double fuzz_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fuzz_report(Fuzz *f, double elapsed) {
+	fprintf(stderr, "%lu execs (%.0f/s), %u in queue, %u edges, %lu crashes, %lu hangs\n",
+		f->execs, elapsed > 0 ? f->execs / elapsed : 0.0, f->num_queue, f->edges, f->crashes, f->hangs);
+}
+
+/*
+ * Fuzzes for execs runs (0 for no end). run has to be an interpreter
+ * with the profiling hooks.
+ */
+int fuzz_main(Fuzz *f, Machine *m, int (*run)(Machine *), Snapshot *snap, bool set_args, u64 execs) {
+	// Guest output, and run_guest's fault reports, would drown everything
+	// else; what the guest writes is captured and dropped at each reset
+	m->quiet = true;
+	m->sys->capture = true;
+
+	double start = fuzz_seconds();
+	double last = start;
+	u32 seeds = f->num_queue;
+	u64 queued = 0;
+
+	for (u32 pick = 0; execs == 0 || f->execs < execs; pick++) {
+		FuzzInput *parent = &f->queue[pick % f->num_queue];
+		// The seeds run once as they are, to learn what they cover
+		u32 mutants = pick < seeds ? 1 : FUZZ_HAVOC;
+
+		for (u32 i = 0; i < mutants && (execs == 0 || f->execs < execs); i++) {
+			memcpy(f->buf, parent->data, parent->len);
+			f->len = parent->len;
+			if (pick >= seeds) {
+				fuzz_mutate(f);
+			}
+
+			if (!fuzz_reset(f, m, snap, set_args)) {
+				fprintf(stderr, "Unable to restore the guest!\n");
+				return 1;
+			}
+			run_guest(run, m);
+			f->execs++;
+
+			if (m->stop == Stop_Fault) {
+				f->crashes++;
+				if (fuzz_novel(f, f->virgin_crash) != 0) {
+					fuzz_save(f, "crashes", f->crashes);
+				}
+			} else if (m->stop == Stop_Budget) {
+				f->hangs++;
+				memset(f->map, 0, FUZZ_MAP_SIZE);
+			} else {
+				u32 novel = fuzz_novel(f, f->virgin);
+				if (novel == 2) {
+					f->edges = 0;
+					for (u32 e = 0; e < FUZZ_MAP_SIZE; e++) {
+						f->edges += f->virgin[e] != 0xFF;
+					}
+				}
+				if (novel != 0 && pick >= seeds) {
+					fuzz_queue_add(f);
+					fuzz_save(f, "queue", ++queued);
+					parent = &f->queue[pick % f->num_queue];
+				}
+			}
+
+			double now = fuzz_seconds();
+			if (now - last >= 1.0) {
+				fuzz_report(f, now - start);
+				last = now;
+			}
+		}
+	}
+
+	fuzz_report(f, fuzz_seconds() - start);
+	return 0;
+}
+
+#endif
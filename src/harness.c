@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "common.h"
+
+/*
+ * Benchmark harness: assembles each workload with ./asm, counts the guest
+ * instructions it runs once with ./emu --profile, then times a number of
+ * runs under ./emu (with whatever options it was given) and reports wall
+ * time, guest instructions per second and peak RSS, as mean and standard
+ * deviation over the runs. Guest output goes to /dev/null.
+ */
+
+#define BENCH_MAX_ARGS 64
+
+typedef struct Stats {
+	double sum;
+	double sum_sq;
+	u32 n;
+} Stats;
+
+static void stats_add(Stats *s, double x) {
+	s->sum += x;
+	s->sum_sq += x * x;
+	s->n++;
+}
+
+static double stats_mean(Stats *s) {
+	return s->n ? s->sum / s->n : 0.0;
+}
+
+static double stats_stddev(Stats *s) {
+	if (s->n < 2) {
+		return 0.0;
+	}
+	double mean = stats_mean(s);
+	double var = (s->sum_sq - s->n * mean * mean) / (s->n - 1);
+	return var > 0 ? sqrt(var) : 0.0;
+}
+
+static double now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * Runs argv to completion, optionally with its output thrown away, and
+ * returns its exit status (-1 if it didn't exit) along with the wall time
+ * in microseconds and peak RSS in KiB.
+ */
+static int run(char **argv, bool quiet, double *wall_us, long *rss_kb) {
+	double start = now_us();
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (quiet) {
+			int null = open("/dev/null", O_WRONLY);
+			dup2(null, 1);
+			dup2(null, 2);
+		}
+		execv(argv[0], argv);
+		_exit(127);
+	}
+
+	int status;
+	struct rusage usage;
+	if (pid < 0 || wait4(pid, &status, 0, &usage) < 0) {
+		return -1;
+	}
+
+	if (wall_us != NULL) *wall_us = now_us() - start;
+	if (rss_kb != NULL) *rss_kb = usage.ru_maxrss;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// The "instructions" total from an emu --profile JSON file, 0 if it's missing
+static u64 read_instructions(char *path) {
+	FILE *in = fopen(path, "r");
+	if (in == NULL) {
+		return 0;
+	}
+
+	u64 count = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if (sscanf(line, " \"instructions\": %lu", &count) == 1) {
+			break;
+		}
+	}
+
+	fclose(in);
+	return count;
+}
+
+static bool bench(char *src, u32 runs, char **emu_args, u32 num_emu_args) {
+	char bin[512];
+	char json[] = "/tmp/bench_profile_XXXXXX";
+	char *ext = strrchr(src, '.');
+	int stem = ext ? (int)(ext - src) : (int)strlen(src);
+	snprintf(bin, sizeof(bin), "%.*s.bin", stem, src);
+
+	char *asm_argv[] = { "./asm", src, bin, NULL };
+	if (run(asm_argv, true, NULL, NULL) != 0) {
+		printf("%s: unable to assemble\n", src);
+		return false;
+	}
+
+	int fd = mkstemp(json);
+	if (fd < 0) {
+		printf("Unable to create a profile file!\n");
+		return false;
+	}
+	close(fd);
+
+	char *profile_argv[] = { "./emu", "--profile", json, bin, NULL };
+	int expected = run(profile_argv, true, NULL, NULL);
+	u64 instructions = read_instructions(json);
+	unlink(json);
+	if (instructions == 0) {
+		printf("%s: unable to count instructions\n", src);
+		return false;
+	}
+
+	char *argv[BENCH_MAX_ARGS + 3];
+	u32 argc = 0;
+	argv[argc++] = "./emu";
+	for (u32 i = 0; i < num_emu_args; i++) {
+		argv[argc++] = emu_args[i];
+	}
+	argv[argc++] = bin;
+	argv[argc] = NULL;
+
+	Stats wall = {0};
+	Stats mips = {0};
+	Stats rss = {0};
+	for (u32 i = 0; i < runs; i++) {
+		double wall_us;
+		long rss_kb;
+		int status = run(argv, true, &wall_us, &rss_kb);
+		if (status != expected) {
+			printf("%s: exited with %d, expected %d\n", src, status, expected);
+			return false;
+		}
+
+		stats_add(&wall, wall_us / 1000);
+		stats_add(&mips, instructions / wall_us);
+		stats_add(&rss, rss_kb / 1024.0);
+	}
+
+	char *name = strrchr(src, '/') ? strrchr(src, '/') + 1 : src;
+	printf("%-16s %12lu %10.2f ± %-8.2f %9.1f ± %-7.1f %7.1f ± %.1f\n", name, instructions,
+		stats_mean(&wall), stats_stddev(&wall), stats_mean(&mips), stats_stddev(&mips),
+		stats_mean(&rss), stats_stddev(&rss));
+	return true;
+}
+
+void usage(char *name) {
+	printf("Usage: %s [options] <workload.asm>...\n", name);
+	printf("  -n <runs>          times to run each workload (default 5)\n");
+	printf("  -e \"<options>\"     options to run emu with, like -e --jit\n");
+	printf("  -h                 show this message\n");
+}
+
+int main(int argc, char *argv[]) {
+	u32 runs = 5;
+	char *emu_args[BENCH_MAX_ARGS];
+	u32 num_emu_args = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:e:h")) != -1) {
+		switch (opt) {
+			case 'n': {
+				runs = strtoul(optarg, NULL, 0);
+			} break;
+			case 'e': {
+				for (char *arg = strtok(optarg, " "); arg != NULL && num_emu_args < BENCH_MAX_ARGS; arg = strtok(NULL, " ")) {
+					emu_args[num_emu_args++] = arg;
+				}
+			} break;
+			default: {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+	}
+
+	if (optind == argc || runs == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	printf("%-16s %12s %21s %19s %15s\n", "workload", "instructions", "wall ms", "MIPS", "peak RSS MiB");
+
+	int ret = 0;
+	for (int i = optind; i < argc; i++) {
+		if (!bench(argv[i], runs, emu_args, num_emu_args)) {
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,291 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "machine.h"
+
+/*
+ * The guest heap: the program break, growing up from the end of the
+ * binary, and anonymous mmaps, handed out top down from HEAP_MMAP_TOP.
+ * All of guest memory is one host reservation, so backing either only
+ * means making pages accessible, and that is done HEAP_CHUNK at a time:
+ * most brk and mmap calls never reach the host kernel.
+ *
+ * Pages the guest munmaps stay accessible, in a pool of free ranges that
+ * later mmaps are carved out of first (zeroed in place, or remapped
+ * fresh when they are large). Ranges of HEAP_RELEASE or more also give
+ * their memory back to the host with MADV_DONTNEED. Pages above the
+ * break and mmap pages never handed out are always zero, so neither
+ * needs clearing when it is taken.
+ *
+ * Every mapping is read/write whatever prot asked for, and there are no
+ * file mappings or MAP_FIXED. The heap keeps clear of the machine's
+ * regions (the binary and its input), and of the stack below STACK_TOP.
+ */
+
+#define HEAP_MMAP_TOP 0x7F000000
+#define HEAP_CHUNK (1 << 20)
+#define HEAP_RELEASE (1 << 20)
+
+typedef struct Heap {
+	pthread_mutex_t lock;
+	u8 *mem;
+	Region *regions;
+	u32 *num_regions;
+
+	u32 brk_base;
+	u32 brk;
+	// [brk_base, brk_end) is accessible
+	u32 brk_end;
+
+	// [mmap_low, HEAP_MMAP_TOP) is accessible, and everything from
+	// mmap_next up has been handed out at some point
+	u32 mmap_low;
+	u32 mmap_next;
+
+	// Free ranges above mmap_next, sorted by address
+	Region *free;
+	u32 num_free;
+	u32 cap_free;
+} Heap;
+
+Heap *heap_init(u8 *mem, Region *regions, u32 *num_regions, u32 brk_base) {
+	Heap *h = (Heap *)calloc(1, sizeof(Heap));
+	pthread_mutex_init(&h->lock, NULL);
+	h->mem = mem;
+	h->regions = regions;
+	h->num_regions = num_regions;
+	h->brk_base = h->brk = h->brk_end = brk_base;
+	h->mmap_low = h->mmap_next = HEAP_MMAP_TOP;
+	return h;
+}
+
+void heap_free(Heap *h) {
+	pthread_mutex_destroy(&h->lock);
+	free(h->free);
+	free(h);
+}
+
+static u32 heap_round(u32 x, u32 to) {
+	return (x + to - 1) & ~(to - 1);
+}
+
+// Whether [start, end) stays off the machine's regions
+static bool heap_clear(Heap *h, u32 start, u32 end) {
+	for (u32 i = 0; i < *h->num_regions; i++) {
+		Region *r = &h->regions[i];
+		if (start < r->start + r->size && r->start < end) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool heap_commit(Heap *h, u32 start, u32 end) {
+	return mprotect(h->mem + start, end - start, PROT_READ | PROT_WRITE) == 0;
+}
+
+static void heap_drop(Heap *h, u32 start, u32 end) {
+	mmap(h->mem + start, end - start, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+}
+
+// Clears a range taken from the pool, remapping it if that's cheaper than memset
+static void heap_zero(Heap *h, u32 start, u32 len) {
+	if (len >= HEAP_RELEASE) {
+		mmap(h->mem + start, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	} else {
+		memset(h->mem + start, 0, len);
+	}
+}
+
+// Adds [start, end) to the pool, merged with any free range it overlaps or touches
+static void heap_pool_add(Heap *h, u32 start, u32 end) {
+	u32 i = 0;
+	while (i < h->num_free && h->free[i].start + h->free[i].size < start) {
+		i++;
+	}
+
+	u32 j = i;
+	while (j < h->num_free && h->free[j].start <= end) {
+		if (h->free[j].start < start) start = h->free[j].start;
+		if (h->free[j].start + h->free[j].size > end) end = h->free[j].start + h->free[j].size;
+		j++;
+	}
+
+	if (i == j) {
+		if (h->num_free == h->cap_free) {
+			h->cap_free = h->cap_free ? h->cap_free * 2 : 16;
+			h->free = (Region *)realloc(h->free, h->cap_free * sizeof(Region));
+		}
+		memmove(&h->free[i + 1], &h->free[i], (h->num_free - i) * sizeof(Region));
+		h->num_free++;
+	} else {
+		memmove(&h->free[i + 1], &h->free[j], (h->num_free - j) * sizeof(Region));
+		h->num_free -= j - i - 1;
+	}
+
+	h->free[i].start = start;
+	h->free[i].size = end - start;
+}
+
+// Takes len bytes from the first free range big enough, if there is one
+static bool heap_pool_take(Heap *h, u32 len, u32 *addr) {
+	for (u32 i = 0; i < h->num_free; i++) {
+		Region *r = &h->free[i];
+		if (r->size < len) {
+			continue;
+		}
+
+		*addr = r->start;
+		r->start += len;
+		r->size -= len;
+		if (r->size == 0) {
+			memmove(r, r + 1, (h->num_free - i - 1) * sizeof(Region));
+			h->num_free--;
+		}
+		return true;
+	}
+	return false;
+}
+
+// Sets the break to addr and returns it, or returns the old break if addr won't do (or is 0)
+u32 heap_brk(Heap *h, u32 addr) {
+	pthread_mutex_lock(&h->lock);
+
+	if (addr >= h->brk_base && addr <= h->mmap_low) {
+		u32 page = getpagesize();
+		bool ok = true;
+		if (addr > h->brk_end) {
+			u32 end = heap_round(addr, HEAP_CHUNK);
+			if (end > h->mmap_low || !heap_clear(h, h->brk_end, end)) {
+				end = heap_round(addr, page);
+			}
+			ok = heap_clear(h, h->brk_end, end) && heap_commit(h, h->brk_end, end);
+			if (ok) {
+				h->brk_end = end;
+			}
+		}
+
+		if (ok) {
+			if (addr < h->brk) {
+				memset(h->mem + addr, 0, h->brk - addr);
+			}
+			h->brk = addr;
+		}
+	}
+
+	u32 brk = h->brk;
+	pthread_mutex_unlock(&h->lock);
+	return brk;
+}
+
+// Returns the address of len fresh zero bytes, or -errno
+i32 heap_mmap(Heap *h, u32 len) {
+	u32 page = getpagesize();
+	if (len == 0 || len > HEAP_MMAP_TOP) {
+		return -EINVAL;
+	}
+	len = heap_round(len, page);
+
+	pthread_mutex_lock(&h->lock);
+
+	u32 addr;
+	if (heap_pool_take(h, len, &addr)) {
+		heap_zero(h, addr, len);
+		pthread_mutex_unlock(&h->lock);
+		return addr;
+	}
+
+	addr = h->mmap_next - len;
+	if (len > h->mmap_next || addr < h->brk_end) {
+		pthread_mutex_unlock(&h->lock);
+		return -ENOMEM;
+	}
+
+	if (addr < h->mmap_low) {
+		u32 low = addr & ~(HEAP_CHUNK - 1);
+		if (low < h->brk_end || !heap_clear(h, low, h->mmap_low)) {
+			low = addr;
+		}
+		if (!heap_clear(h, low, h->mmap_low) || !heap_commit(h, low, h->mmap_low)) {
+			pthread_mutex_unlock(&h->lock);
+			return -ENOMEM;
+		}
+		h->mmap_low = low;
+	}
+
+	h->mmap_next = addr;
+	pthread_mutex_unlock(&h->lock);
+	return addr;
+}
+
+// Frees whatever part of [addr, addr + len) came from heap_mmap
+i32 heap_munmap(Heap *h, u32 addr, u32 len) {
+	u32 page = getpagesize();
+	if ((addr & (page - 1)) != 0 || len == 0) {
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&h->lock);
+
+	u64 end = (u64)addr + heap_round(len, page);
+	u32 start = addr > h->mmap_next ? addr : h->mmap_next;
+	if (end > HEAP_MMAP_TOP) {
+		end = HEAP_MMAP_TOP;
+	}
+
+	if (start < end) {
+		if (end - start >= HEAP_RELEASE) {
+			madvise(h->mem + start, end - start, MADV_DONTNEED);
+		}
+		heap_pool_add(h, start, end);
+	}
+
+	pthread_mutex_unlock(&h->lock);
+	return 0;
+}
+
+// A copy of h's bookkeeping, for snapshots
+Heap *heap_copy(Heap *h) {
+	Heap *c = (Heap *)malloc(sizeof(Heap));
+	pthread_mutex_lock(&h->lock);
+	memcpy(c, h, sizeof(Heap));
+	c->free = (Region *)malloc((h->num_free + 1) * sizeof(Region));
+	memcpy(c->free, h->free, h->num_free * sizeof(Region));
+	c->cap_free = h->num_free + 1;
+	pthread_mutex_unlock(&h->lock);
+	pthread_mutex_init(&c->lock, NULL);
+	return c;
+}
+
+// Puts h back the way saved was, making whatever it has grown since inaccessible again
+void heap_restore(Heap *h, Heap *saved) {
+	pthread_mutex_lock(&h->lock);
+
+	if (h->brk_end > saved->brk_end) {
+		heap_drop(h, saved->brk_end, h->brk_end);
+	}
+	if (h->mmap_low < saved->mmap_low) {
+		heap_drop(h, h->mmap_low, saved->mmap_low);
+	}
+
+	h->brk = saved->brk;
+	h->brk_end = saved->brk_end;
+	h->mmap_low = saved->mmap_low;
+	h->mmap_next = saved->mmap_next;
+
+	if (h->cap_free < saved->num_free) {
+		h->cap_free = saved->num_free;
+		h->free = (Region *)realloc(h->free, h->cap_free * sizeof(Region));
+	}
+	memcpy(h->free, saved->free, saved->num_free * sizeof(Region));
+	h->num_free = saved->num_free;
+
+	pthread_mutex_unlock(&h->lock);
+}
+
+#endif
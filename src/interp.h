@@ -0,0 +1,451 @@
+/*
+ * The interpreter, instantiated by emu.c once per INTERP_NAME. With
+ * INTERP_HOOKS set every handler reports what it did through HOOK(),
+ * which is what tracing (and other instrumentation) hangs off; without
+ * it the hooks compile away entirely. INTERP_PROFILE keeps just the much
+ * cheaper per-block and per-call hooks the profilers need. Called with NULL it
+ * publishes its handler addresses into handlers[] so blocks can be bound
+ * to it.
+ */
+
+int INTERP_NAME(Machine *m) {
+	static void *labels[Kind_Count] = {
+		[Kind_Nop] = &&op_nop,         [Kind_Sll] = &&op_sll,
+		[Kind_Jr] = &&op_jr,           [Kind_Syscall] = &&op_syscall,
+		[Kind_Mult] = &&op_mult,       [Kind_Multu] = &&op_multu,
+		[Kind_Add] = &&op_add,         [Kind_Addu] = &&op_addu,
+		[Kind_Sub] = &&op_sub,         [Kind_J] = &&op_j,
+		[Kind_Jal] = &&op_jal,         [Kind_Beq] = &&op_beq,
+		[Kind_Bne] = &&op_bne,         [Kind_Addi] = &&op_addi,
+		[Kind_Addiu] = &&op_addiu,     [Kind_Ori] = &&op_ori,
+		[Kind_Lui] = &&op_lui,         [Kind_Lb] = &&op_lb,
+		[Kind_Lw] = &&op_lw,           [Kind_Sb] = &&op_sb,
+		[Kind_Sw] = &&op_sw,           [Kind_Ll] = &&op_ll,
+		[Kind_Sc] = &&op_sc,           [Kind_Sync] = &&op_sync,
+		[Kind_Illegal] = &&op_illegal,
+		[Kind_End] = &&op_end,         [Kind_Chain] = &&op_chain,
+	};
+
+	static void *fused[Fuse_Count] = {
+		[Fuse_LuiOri] = &&op_lui_ori,
+		[Fuse_AddiuAddiu] = &&op_addiu_addiu,
+		[Fuse_AddiuBne] = &&op_addiu_bne,
+		[Fuse_AddiuBeq] = &&op_addiu_beq,
+		[Fuse_AddiuAddiuBne] = &&op_addiu_addiu_bne,
+	};
+
+	if (m == NULL) {
+		handlers = labels;
+		fused_handlers = fused;
+		return 0;
+	}
+
+	m->stop = Stop_Exit;
+
+	u32 *reg = m->reg;
+	u8 *bin_8 = m->mem;
+	bool jit_on = m->jit != NULL;
+	Block *blk;
+	Decoded *d;
+
+#if INTERP_HOOKS
+#define HOOK(dest, value, addr) do {                          \
+		if (m->trace) trace_push(m->trace, PC(), d->op, (dest), (value), (addr)); \
+	} while (0)
+#else
+#define HOOK(dest, value, addr)
+#endif
+
+#if INTERP_HOOKS || INTERP_PROFILE
+// Profiling counts whole blocks, and the branches that were taken
+#define HOOK_ENTER() do {                                     \
+		if (m->profile) profile_enter(m->profile, (blk->pc - m->code_base) / 4, blk->len); \
+		if (m->flame && (m->flame->countdown -= blk->len) <= 0) flame_sample(m->flame); \
+		if (m->cachesim) cachesim_fetch(m->cachesim, blk->pc, blk->len); \
+		if (m->timing) timing_enter(m->timing, blk);           \
+		if (m->fuzz) fuzz_edge(m->fuzz, blk->pc);              \
+	} while (0)
+#define HOOK_MEM(addr, write) do {                            \
+		if (m->cachesim) cachesim_data(m->cachesim, (PC() - m->code_base) / 4, (addr), (write)); \
+		if (m->fuzz && (write)) fuzz_dirty(m->fuzz, (addr));  \
+	} while (0)
+// Before and after a syscall, which clobbers the number in v0
+#define HOOK_SYSCALL(num) do {                                \
+		if (m->fuzz) m->fuzz->syscall = (num);                \
+	} while (0)
+#define HOOK_SYSCALL_DONE() do {                              \
+		if (m->fuzz) fuzz_syscall(m->fuzz, reg);              \
+	} while (0)
+#define HOOK_CALL(func, ret) do {                             \
+		if (m->flame) flame_call(m->flame, (func), (ret));    \
+	} while (0)
+#define HOOK_RETURN(target) do {                              \
+		if (m->flame) flame_return(m->flame, (target));       \
+	} while (0)
+#define HOOK_TAKEN() do {                                     \
+		if (m->profile) m->profile->taken[(PC() - m->code_base) / 4]++; \
+		if (m->timing) m->timing->taken = true;                \
+	} while (0)
+#define HOOK_CUT(pc) do {                                     \
+		if (m->profile) profile_cut(m->profile, ((pc) - m->code_base) / 4); \
+	} while (0)
+#else
+#define HOOK_ENTER()
+#define HOOK_MEM(addr, write)
+#define HOOK_SYSCALL(num)
+#define HOOK_SYSCALL_DONE()
+#define HOOK_CALL(func, ret)
+#define HOOK_RETURN(target)
+#define HOOK_TAKEN()
+#define HOOK_CUT(pc)
+#endif
+
+#define DISPATCH() goto *d->handler
+#define NEXT() do { d++; DISPATCH(); } while (0)
+#define PC() (blk->pc + (u32)(d - blk->ops) * 4)
+#define ENTER(b) do {                                         \
+		blk = (b);                                            \
+		if (m->budget <= 0) goto preempt;                     \
+		m->budget -= blk->len;                                \
+		if (jit_on) goto jit_entry;                           \
+		HOOK_ENTER();                                         \
+		d = blk->ops;                                         \
+		DISPATCH();                                           \
+	} while (0)
+#define EXIT(target) do { m->pc = (target); return 0; } while (0)
+// A guest fault the host doesn't trap on: stops at the current op
+#define FAULT(kind, addr) do {                                \
+		fault_kind = (kind);                                  \
+		fault_addr = (addr);                                  \
+		m->pc = PC();                                         \
+		m->stop = Stop_Fault;                                 \
+		return 1;                                             \
+	} while (0)
+// The running block was just flushed: resume after the store in a fresh one
+#define EXIT_WRITTEN(resume) do {                             \
+		u32 _resume = (resume);                               \
+		HOOK_CUT(_resume);                                    \
+		blk = block_lookup(m, _resume);                       \
+		if (blk == NULL) EXIT(_resume);                       \
+		ENTER(blk);                                           \
+	} while (0)
+// Follow a cached successor link, building and linking it on first use
+#define CHAIN(link, target) do {                              \
+		Block *_next = blk->link;                             \
+		if (_next == NULL) {                                  \
+			u32 _target = (target);                           \
+			_next = block_lookup(m, _target);                 \
+			if (_next == NULL) EXIT(_target);                 \
+			blk->link = _next;                                \
+		}                                                     \
+		ENTER(_next);                                         \
+	} while (0)
+
+	blk = block_lookup(m, m->pc);
+	if (blk == NULL) {
+		return 0;
+	}
+	ENTER(blk);
+
+op_nop:
+	HOOK(0, 0, 0);
+	NEXT();
+op_sll:
+	reg[d->rd] = reg[d->rt] << d->sa;
+	HOOK(d->rd, reg[d->rd], 0);
+	NEXT();
+op_jr: {
+	HOOK(0, reg[d->rs], 0);
+	// Indirect: taken caches the last target and is checked before use
+	u32 target = reg[d->rs];
+	HOOK_RETURN(target);
+	if (blk->taken == NULL || blk->taken->pc != target) {
+		Block *next = block_lookup(m, target);
+		if (next == NULL) EXIT(target);
+		blk->taken = next;
+	}
+	ENTER(blk->taken);
+}
+op_syscall: {
+	HOOK(0, reg[2], 0);
+	if (m->trap_syscalls) {
+		m->pc = PC();
+		m->stop = Stop_Syscall;
+		return 0;
+	}
+	HOOK_SYSCALL(reg[2]);
+	u32 action = syscall_exec(m->sys, reg, bin_8);
+	HOOK_SYSCALL_DONE();
+	if (action == Sys_Spawn) {
+		reg[2] = hart_spawn(m, reg[4], reg[5], reg[6]);
+		action = Sys_Continue;
+	}
+
+	if (action == Sys_Exit) {
+		m->pc = PC();
+		return reg[4];
+	}
+
+	if (action != Sys_Continue) {
+		if (m->sched == NULL) {
+			sys_wait(action, reg, bin_8);
+		} else {
+			// Parked: the scheduler picks it up again after the syscall
+			m->pc = PC() + 4;
+			m->stop = action == Sys_Sleep ? Stop_Sleep : action == Sys_Io ? Stop_Io : Stop_Yield;
+			m->sleep_us = action == Sys_Sleep ? sys_sleep_us(reg, bin_8) : 0;
+			return 0;
+		}
+	}
+	CHAIN(fall, PC() + 4);
+}
+op_mult: {
+	i64 prod = (i64)(i32)reg[d->rs] * (i64)(i32)reg[d->rt];
+	m->hi = (u64)prod >> 32;
+	m->lo = (u32)prod;
+	HOOK(0, m->lo, 0);
+	NEXT();
+}
+op_multu: {
+	u64 prod = (u64)reg[d->rs] * (u64)reg[d->rt];
+	m->hi = prod >> 32;
+	m->lo = (u32)prod;
+	HOOK(0, m->lo, 0);
+	NEXT();
+}
+op_add:
+	reg[d->rd] = reg[d->rs] + reg[d->rt];
+	HOOK(d->rd, reg[d->rd], 0);
+	NEXT();
+op_addu:
+	reg[d->rd] = reg[d->rs] + reg[d->rt];
+	HOOK(d->rd, reg[d->rd], 0);
+	NEXT();
+op_sub:
+	reg[d->rd] = reg[d->rs] - reg[d->rt];
+	HOOK(d->rd, reg[d->rd], 0);
+	NEXT();
+op_j:
+	HOOK(0, 0, 0);
+	CHAIN(taken, d->imm);
+op_jal:
+	reg[31] = PC() + 8;
+	HOOK(31, reg[31], 0);
+	HOOK_CALL(d->imm, reg[31]);
+	CHAIN(taken, d->imm);
+op_beq:
+	HOOK(0, 0, 0);
+	if (reg[d->rs] == reg[d->rt]) {
+		HOOK_TAKEN();
+		CHAIN(taken, d->imm);
+	}
+	CHAIN(fall, PC() + 4);
+op_bne:
+	HOOK(0, 0, 0);
+	if (reg[d->rs] != reg[d->rt]) {
+		HOOK_TAKEN();
+		CHAIN(taken, d->imm);
+	}
+	CHAIN(fall, PC() + 4);
+op_addi:
+	reg[d->rt] = reg[d->rs] + d->imm;
+	HOOK(d->rt, reg[d->rt], 0);
+	NEXT();
+op_addiu:
+	reg[d->rt] = reg[d->rs] + d->imm;
+	HOOK(d->rt, reg[d->rt], 0);
+	NEXT();
+op_ori:
+	reg[d->rt] = reg[d->rs] | d->imm;
+	HOOK(d->rt, reg[d->rt], 0);
+	NEXT();
+op_lui:
+	reg[d->rt] = d->imm;
+	HOOK(d->rt, reg[d->rt], 0);
+	NEXT();
+op_lb: {
+	u32 idx = reg[d->rs] + d->imm;
+	reg[d->rt] = bin_8[idx];
+	HOOK(d->rt, reg[d->rt], idx);
+	HOOK_MEM(idx, false);
+	NEXT();
+}
+op_lw: {
+	u32 idx = reg[d->rs] + d->imm;
+	if ((idx % 4) != 0) {
+		FAULT(Fault_Unaligned, idx);
+	}
+
+	memcpy(&reg[d->rt], bin_8 + idx, sizeof(u32));
+	HOOK(d->rt, reg[d->rt], idx);
+	HOOK_MEM(idx, false);
+	NEXT();
+}
+op_sb: {
+	u32 idx = reg[d->rs] + d->imm;
+	bin_8[idx] = reg[d->rt];
+	HOOK(0, reg[d->rt] & 0xFF, idx);
+	HOOK_MEM(idx, true);
+	u32 resume = PC() + 4;
+	if (in_code(m, idx) && code_written(m, idx, 1, blk)) {
+		EXIT_WRITTEN(resume);
+	}
+	NEXT();
+}
+op_sw: {
+	u32 idx = reg[d->rs] + d->imm;
+	if ((idx % 4) != 0) {
+		FAULT(Fault_Unaligned, idx);
+	}
+
+	memcpy(bin_8 + idx, &reg[d->rt], sizeof(u32));
+	HOOK(0, reg[d->rt], idx);
+	HOOK_MEM(idx, true);
+	u32 resume = PC() + 4;
+	if (in_code(m, idx) && code_written(m, idx, 4, blk)) {
+		EXIT_WRITTEN(resume);
+	}
+	NEXT();
+}
+op_ll: {
+	u32 idx = reg[d->rs] + d->imm;
+	if ((idx % 4) != 0) {
+		FAULT(Fault_Unaligned, idx);
+	}
+
+	u32 val = __atomic_load_n((u32 *)(bin_8 + idx), __ATOMIC_SEQ_CST);
+	m->ll_addr = idx;
+	m->ll_value = val;
+	m->ll_valid = true;
+	if (d->rt != 0) {
+		reg[d->rt] = val;
+	}
+	HOOK(d->rt, val, idx);
+	HOOK_MEM(idx, false);
+	NEXT();
+}
+op_sc: {
+	u32 idx = reg[d->rs] + d->imm;
+	if ((idx % 4) != 0) {
+		FAULT(Fault_Unaligned, idx);
+	}
+
+	// Succeeds if the word still holds what ll saw, like a host cas
+	u32 ok = m->ll_valid && m->ll_addr == idx &&
+		__atomic_compare_exchange_n((u32 *)(bin_8 + idx), &m->ll_value, reg[d->rt],
+			false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	m->ll_valid = false;
+	if (d->rt != 0) {
+		reg[d->rt] = ok;
+	}
+	HOOK(d->rt, ok, idx);
+	HOOK_MEM(idx, ok);
+	u32 resume = PC() + 4;
+	if (ok && in_code(m, idx) && code_written(m, idx, 4, blk)) {
+		EXIT_WRITTEN(resume);
+	}
+	NEXT();
+}
+op_sync:
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	HOOK(0, 0, 0);
+	NEXT();
+
+	// Superinstructions: each op still runs (and hooks) in turn, d moving
+	// along with them, but what follows the first is a direct jump
+op_lui_ori:
+	reg[d->rt] = d->imm;
+	HOOK(d->rt, reg[d->rt], 0);
+	d++;
+	goto op_ori;
+op_addiu_addiu:
+	reg[d->rt] = reg[d->rs] + d->imm;
+	HOOK(d->rt, reg[d->rt], 0);
+	d++;
+	goto op_addiu;
+op_addiu_bne:
+	reg[d->rt] = reg[d->rs] + d->imm;
+	HOOK(d->rt, reg[d->rt], 0);
+	d++;
+	goto op_bne;
+op_addiu_beq:
+	reg[d->rt] = reg[d->rs] + d->imm;
+	HOOK(d->rt, reg[d->rt], 0);
+	d++;
+	goto op_beq;
+op_addiu_addiu_bne:
+	reg[d->rt] = reg[d->rs] + d->imm;
+	HOOK(d->rt, reg[d->rt], 0);
+	d++;
+	goto op_addiu_bne;
+
+op_illegal:
+	HOOK(0, 0, 0);
+	FAULT(Fault_Illegal, PC());
+op_end:
+	HOOK_CUT(PC());
+	m->pc = PC();
+	return 0;
+op_chain:
+	CHAIN(fall, PC());
+
+	// Out of budget: stop before running blk, to resume at its start
+preempt:
+	m->pc = blk->pc;
+	m->stop = Stop_Budget;
+	return 0;
+
+	// Runs native blocks back to back, dropping into the interpreter for
+	// blocks that aren't hot yet or that the native code bailed out of
+jit_entry:
+	while (true) {
+		JitFn native = __atomic_load_n(&blk->native, __ATOMIC_ACQUIRE);
+		if (native == NULL) {
+			if (blk->no_jit || ++blk->hits < JIT_THRESHOLD || !jit_request(m, blk)) {
+				break;
+			}
+			native = blk->native;
+		}
+
+		u32 next = native(reg, bin_8, m);
+		blk = block_lookup(m, next);
+		if (blk == NULL) {
+			EXIT(next);
+		}
+
+		if (m->budget <= 0) {
+			m->jit_bail = 0;
+			goto preempt;
+		}
+		m->budget -= blk->len;
+
+		if (m->jit_bail) {
+			m->jit_bail = 0;
+			break;
+		}
+	}
+	d = blk->ops;
+	DISPATCH();
+
+#undef EXIT_WRITTEN
+#undef CHAIN
+#undef FAULT
+#undef EXIT
+#undef ENTER
+#undef PC
+#undef NEXT
+#undef DISPATCH
+#undef HOOK_CUT
+#undef HOOK_TAKEN
+#undef HOOK_RETURN
+#undef HOOK_CALL
+#undef HOOK_SYSCALL_DONE
+#undef HOOK_SYSCALL
+#undef HOOK_MEM
+#undef HOOK_ENTER
+#undef HOOK
+}
+
+#undef INTERP_NAME
+#undef INTERP_HOOKS
+#undef INTERP_PROFILE
@@ -0,0 +1,669 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "mips.h"
+#include "machine.h"
+
+/*
+ * x86-64 backend. A block that has been entered JIT_THRESHOLD times is
+ * translated into native code in an executable buffer. rbx holds the
+ * guest register file, r15 guest memory and rbp the Machine; the most
+ * used guest registers of the block live in r12-r14 for its duration.
+ * Anything the backend doesn't handle (syscalls, unknown ops, unaligned
+ * accesses) exits with jit_bail set so the interpreter runs that block.
+ *
+ * In tiered mode hot blocks are queued for a background thread instead of
+ * being compiled inline, and the interpreter keeps running them until the
+ * native code is published into blk->native.
+ */
+
+#define JIT_THRESHOLD 16
+#define JIT_BUF_SIZE (16 * 1024 * 1024)
+/*
+ * Most code one op can emit. The biggest is a sw at about 185 bytes: the
+ * address, an alignment check with a whole exit in it, the range check,
+ * the call to jit_store and a second exit. A branch back to the block's
+ * own start is about 160, with the budget check in each of its two exits.
+ */
+#define JIT_MAX_OP_BYTES 256
+#define JIT_PINNED 3
+#define JIT_QUEUE_SIZE 256
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R8  8
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_LE 0xE
+
+typedef struct Jit {
+	u8 *buf;
+	u32 size;
+	u32 used;
+
+	// Everything below is only used in tiered mode; lock guards the
+	// buffer, the queue and block lifetimes against the compiler thread
+	bool tiered;
+	bool full;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	Block *queue[JIT_QUEUE_SIZE];
+	u32 head;
+	u32 tail;
+} Jit;
+
+typedef struct Emitter {
+	u8 *p;
+	u8 *head;
+	u8 pin[32];
+	u8 pinned[JIT_PINNED];
+	u32 num_pinned;
+} Emitter;
+
+Jit *jit_init() {
+#ifndef __x86_64__
+	printf("The jit needs an x86-64 host!\n");
+	return NULL;
+#endif
+
+	u8 *buf = mmap(NULL, JIT_BUF_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		printf("Failed to map jit buffer!\n");
+		return NULL;
+	}
+
+	Jit *jit = (Jit *)calloc(1, sizeof(Jit));
+	jit->buf = buf;
+	jit->size = JIT_BUF_SIZE;
+	return jit;
+}
+
+void jit_free(Jit *jit) {
+	munmap(jit->buf, jit->size);
+	free(jit);
+}
+
+// Throws away all native code; only safe with no native frames live
+void jit_flush(Machine *m) {
+	for (Block *b = m->block_list; b != NULL; b = b->next) {
+		b->native = NULL;
+		b->hits = 0;
+		b->queued = false;
+	}
+	m->jit->used = 0;
+	m->jit->head = m->jit->tail = 0;
+}
+
+void jit_lock(Machine *m) {
+	if (m->jit != NULL && m->jit->tiered) {
+		pthread_mutex_lock(&m->jit->lock);
+	}
+}
+
+void jit_unlock(Machine *m) {
+	if (m->jit != NULL && m->jit->tiered) {
+		pthread_mutex_unlock(&m->jit->lock);
+	}
+}
+
+// Drops a block that is about to be freed from the compile queue
+void jit_forget(Machine *m, Block *b) {
+	Jit *jit = m->jit;
+	if (jit == NULL || !b->queued) {
+		return;
+	}
+
+	for (u32 i = jit->head; i != jit->tail; i++) {
+		if (jit->queue[i % JIT_QUEUE_SIZE] == b) {
+			jit->queue[i % JIT_QUEUE_SIZE] = NULL;
+		}
+	}
+}
+
+// Slow path for guest stores that land inside the image
+u32 jit_store(Machine *m, u32 addr, u32 val, u32 width, Block *cur) {
+	if (width == 1) {
+		m->mem[addr] = val;
+	} else {
+		memcpy(m->mem + addr, &val, sizeof(val));
+	}
+
+	return code_written(m, addr, width, cur);
+}
+
+static void emit8(Emitter *e, u8 b) {
+	*e->p++ = b;
+}
+
+static void emit32(Emitter *e, u32 v) {
+	memcpy(e->p, &v, sizeof(v));
+	e->p += sizeof(v);
+}
+
+static void emit64(Emitter *e, u64 v) {
+	memcpy(e->p, &v, sizeof(v));
+	e->p += sizeof(v);
+}
+
+static void emit_rex(Emitter *e, bool w, u8 r, u8 x, u8 b) {
+	u8 rex = 0x40 | (w << 3) | ((r >> 3) << 2) | ((x >> 3) << 1) | (b >> 3);
+	if (rex != 0x40) {
+		emit8(e, rex);
+	}
+}
+
+// op r/m32, r32 (0x89 mov, 0x01 add, 0x29 sub, 0x09 or, 0x31 xor, 0x39 cmp)
+static void emit_rr(Emitter *e, u8 opcode, u8 dst, u8 src) {
+	emit_rex(e, false, src, 0, dst);
+	emit8(e, opcode);
+	emit8(e, 0xC0 | (src & 7) << 3 | (dst & 7));
+}
+
+// op r32, [base + disp] or op [base + disp], r32; base is rbx or rbp
+static void emit_mem(Emitter *e, u8 opcode, u8 r, u8 base, i32 disp) {
+	emit_rex(e, false, r, 0, base);
+	emit8(e, opcode);
+	if (disp >= -128 && disp < 128) {
+		emit8(e, 0x40 | (r & 7) << 3 | (base & 7));
+		emit8(e, (u8)disp);
+	} else {
+		emit8(e, 0x80 | (r & 7) << 3 | (base & 7));
+		emit32(e, disp);
+	}
+}
+
+// op r/m32, imm32 (ext 0 add, 1 or, 7 cmp)
+static void emit_ri(Emitter *e, u8 ext, u8 r, u32 imm) {
+	emit_rex(e, false, 0, 0, r);
+	emit8(e, 0x81);
+	emit8(e, 0xC0 | ext << 3 | (r & 7));
+	emit32(e, imm);
+}
+
+static void emit_mov_imm(Emitter *e, u8 r, u32 imm) {
+	emit_rex(e, false, 0, 0, r);
+	emit8(e, 0xB8 + (r & 7));
+	emit32(e, imm);
+}
+
+// Access to guest memory at [r15 + rcx]
+static void emit_guest_mem(Emitter *e, u8 opcode_1, u8 opcode_2, u8 r) {
+	emit_rex(e, false, r, RCX, R15);
+	emit8(e, opcode_1);
+	if (opcode_2) {
+		emit8(e, opcode_2);
+	}
+	emit8(e, 0x04 | (r & 7) << 3);
+	emit8(e, (RCX & 7) << 3 | (R15 & 7));
+}
+
+static u8 *emit_jcc(Emitter *e, u8 cc) {
+	emit8(e, 0x0F);
+	emit8(e, 0x80 | cc);
+	emit32(e, 0);
+	return e->p - 4;
+}
+
+static u8 *emit_jmp(Emitter *e) {
+	emit8(e, 0xE9);
+	emit32(e, 0);
+	return e->p - 4;
+}
+
+static void patch(u8 *at, u8 *target) {
+	i32 rel = (i32)(target - (at + 4));
+	memcpy(at, &rel, sizeof(rel));
+}
+
+// Host register holding guest register g, loaded into scratch if not pinned
+static u8 emit_get(Emitter *e, u8 g, u8 scratch) {
+	if (g == 0) {
+		emit_rr(e, 0x31, scratch, scratch);
+		return scratch;
+	}
+
+	if (e->pin[g]) {
+		return e->pin[g];
+	}
+
+	emit_mem(e, 0x8B, scratch, RBX, g * 4);
+	return scratch;
+}
+
+static void emit_set(Emitter *e, u8 g, u8 src) {
+	if (e->pin[g]) {
+		if (e->pin[g] != src) {
+			emit_rr(e, 0x89, e->pin[g], src);
+		}
+	} else {
+		emit_mem(e, 0x89, src, RBX, g * 4);
+	}
+}
+
+static void emit_writeback(Emitter *e) {
+	for (u32 i = 0; i < e->num_pinned; i++) {
+		u8 g = e->pinned[i];
+		emit_mem(e, 0x89, e->pin[g], RBX, g * 4);
+	}
+}
+
+// Returns to the dispatcher with the next guest pc already in eax
+static void emit_leave(Emitter *e, bool bail) {
+	if (bail) {
+		// mov byte [rbp + jit_bail], 1
+		emit8(e, 0xC6);
+		emit8(e, 0x85);
+		emit32(e, offsetof(Machine, jit_bail));
+		emit8(e, 1);
+	}
+
+	// add rsp, 8; pop r15, r14, r13, r12, rbp, rbx; ret
+	static const u8 epilogue[] = {
+		0x48, 0x83, 0xC4, 0x08,
+		0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C,
+		0x5D, 0x5B, 0xC3
+	};
+	memcpy(e->p, epilogue, sizeof(epilogue));
+	e->p += sizeof(epilogue);
+}
+
+static void emit_exit(Emitter *e, u32 pc, bool bail) {
+	emit_writeback(e);
+	emit_mov_imm(e, RAX, pc);
+	emit_leave(e, bail);
+}
+
+static void emit_exit_to(Emitter *e, Block *b, u32 target) {
+	if (target == b->pc) {
+		// cmp qword [rbp + budget], 0; leave for the dispatcher once it has run out
+		emit8(e, 0x48);
+		emit8(e, 0x83);
+		emit8(e, 0xBD);
+		emit32(e, offsetof(Machine, budget));
+		emit8(e, 0);
+		u8 *out = emit_jcc(e, CC_LE);
+		// sub qword [rbp + budget], len
+		emit8(e, 0x48);
+		emit8(e, 0x81);
+		emit8(e, 0xAD);
+		emit32(e, offsetof(Machine, budget));
+		emit32(e, b->len);
+		patch(emit_jmp(e), e->head);
+		patch(out, e->p);
+		emit_exit(e, target, false);
+	} else {
+		emit_exit(e, target, false);
+	}
+}
+
+// ecx = reg[rs] + imm
+static void emit_addr(Emitter *e, Decoded *d) {
+	u8 base = emit_get(e, d->rs, RCX);
+	if (base != RCX) {
+		emit_rr(e, 0x89, RCX, base);
+	}
+	if (d->imm) {
+		emit_ri(e, 0, RCX, d->imm);
+	}
+}
+
+static void emit_align_check(Emitter *e, u32 pc) {
+	// test cl, 3
+	emit8(e, 0xF6);
+	emit8(e, 0xC1);
+	emit8(e, 0x03);
+	u8 *ok = emit_jcc(e, CC_E);
+	emit_exit(e, pc, true);
+	patch(ok, e->p);
+}
+
+static void emit_store(Emitter *e, Machine *m, Block *b, Decoded *d, u32 pc, u32 width) {
+	emit_addr(e, d);
+	if (width == 4) {
+		emit_align_check(e, pc);
+	}
+
+	u8 val = emit_get(e, d->rt, RDX);
+	if (val != RDX) {
+		emit_rr(e, 0x89, RDX, val);
+	}
+
+	// Only stores into the text go through the helper
+	emit_rr(e, 0x89, RAX, RCX);
+	emit_ri(e, 5, RAX, m->code_base);
+	emit_ri(e, 7, RAX, m->code_size * 4);
+	u8 *fast = emit_jcc(e, CC_AE);
+
+	// jit_store(m, addr, val, width, b)
+	static const u8 setup[] = { 0x48, 0x89, 0xEF, 0x89, 0xCE };
+	memcpy(e->p, setup, sizeof(setup));
+	e->p += sizeof(setup);
+	emit_mov_imm(e, RCX, width);
+	emit8(e, 0x49);
+	emit8(e, 0xB8);
+	emit64(e, (u64)b);
+	emit8(e, 0x48);
+	emit8(e, 0xB8);
+	emit64(e, (u64)jit_store);
+	emit8(e, 0xFF);
+	emit8(e, 0xD0);
+
+	// The store rewrote code: leave before running anything stale
+	emit_rr(e, 0x85, RAX, RAX);
+	u8 *same = emit_jcc(e, CC_E);
+	emit_exit(e, pc + 4, false);
+	patch(same, e->p);
+	u8 *done = emit_jmp(e);
+
+	patch(fast, e->p);
+	if (width == 1) {
+		emit_guest_mem(e, 0x88, 0, RDX);
+	} else {
+		emit_guest_mem(e, 0x89, 0, RDX);
+	}
+	patch(done, e->p);
+}
+
+static void emit_mult(Emitter *e, Decoded *d, bool is_signed) {
+	u8 a = emit_get(e, d->rs, RAX);
+	if (a != RAX) emit_rr(e, 0x89, RAX, a);
+	u8 b = emit_get(e, d->rt, RCX);
+	if (b != RCX) emit_rr(e, 0x89, RCX, b);
+
+	if (is_signed) {
+		static const u8 sext[] = { 0x48, 0x63, 0xC0, 0x48, 0x63, 0xC9 };
+		memcpy(e->p, sext, sizeof(sext));
+		e->p += sizeof(sext);
+	}
+
+	// imul rax, rcx
+	static const u8 imul[] = { 0x48, 0x0F, 0xAF, 0xC1 };
+	memcpy(e->p, imul, sizeof(imul));
+	e->p += sizeof(imul);
+
+	emit_mem(e, 0x89, RAX, RBX, offsetof(Machine, lo) - offsetof(Machine, reg));
+	// shr rax, 32
+	static const u8 shr[] = { 0x48, 0xC1, 0xE8, 0x20 };
+	memcpy(e->p, shr, sizeof(shr));
+	e->p += sizeof(shr);
+	emit_mem(e, 0x89, RAX, RBX, offsetof(Machine, hi) - offsetof(Machine, reg));
+}
+
+static void pick_pinned(Emitter *e, Block *b) {
+	static const u8 host[JIT_PINNED] = { R12, R13, R14 };
+
+	u32 uses[32] = {0};
+	for (u32 i = 0; i < b->len; i++) {
+		Decoded *d = &b->ops[i];
+		uses[d->rs]++;
+		uses[d->rt]++;
+		uses[d->rd]++;
+	}
+	uses[0] = 0;
+
+	for (u32 n = 0; n < JIT_PINNED; n++) {
+		u32 best = 0;
+		for (u32 g = 1; g < 32; g++) {
+			if (!e->pin[g] && uses[g] > uses[best]) {
+				best = g;
+			}
+		}
+
+		if (uses[best] < 2) {
+			break;
+		}
+
+		e->pin[best] = host[n];
+		e->pinned[e->num_pinned++] = best;
+	}
+}
+
+bool jit_supported(u8 kind) {
+	switch (kind) {
+		case Kind_Syscall: case Kind_Illegal: case Kind_End:
+		case Kind_Ll: case Kind_Sc: {
+			return false;
+		} break;
+		default: {
+			return true;
+		}
+	}
+}
+
+/*
+ * Translates blk into the buffer and installs it as blk->native.
+ * Returns false if the block can't be compiled.
+ */
+bool jit_compile(Machine *m, Block *b) {
+	Jit *jit = m->jit;
+
+	if (!jit_supported(b->ops[0].kind)) {
+		__atomic_store_n(&b->no_jit, true, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	u32 worst = 128 + (b->len + 1) * JIT_MAX_OP_BYTES;
+	if (jit->used + worst > jit->size) {
+		// The compiler thread can't tell if native code is running, so
+		// leave the flush to the dispatcher
+		if (jit->tiered) {
+			jit->full = true;
+			return false;
+		}
+		jit_flush(m);
+	}
+
+	Emitter e = {0};
+	u8 *start = jit->buf + jit->used;
+	e.p = start;
+
+	// push rbx, rbp, r12, r13, r14, r15; sub rsp, 8
+	// mov rbx, rdi; mov r15, rsi; mov rbp, rdx
+	static const u8 prologue[] = {
+		0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57,
+		0x48, 0x83, 0xEC, 0x08,
+		0x48, 0x89, 0xFB, 0x49, 0x89, 0xF7, 0x48, 0x89, 0xD5
+	};
+	memcpy(e.p, prologue, sizeof(prologue));
+	e.p += sizeof(prologue);
+
+	pick_pinned(&e, b);
+	for (u32 i = 0; i < e.num_pinned; i++) {
+		u8 g = e.pinned[i];
+		emit_mem(&e, 0x8B, e.pin[g], RBX, g * 4);
+	}
+	e.head = e.p;
+
+	// The last op is either a block terminator or a Chain op
+	for (u32 i = 0; ; i++) {
+		Decoded *d = &b->ops[i];
+		u32 pc = b->pc + i * 4;
+
+		switch (d->kind) {
+			case Kind_Nop: {} break;
+			case Kind_Sll: {
+				u8 src = emit_get(&e, d->rt, RAX);
+				if (src != RAX) emit_rr(&e, 0x89, RAX, src);
+				if (d->sa) {
+					emit8(&e, 0xC1);
+					emit8(&e, 0xE0);
+					emit8(&e, d->sa);
+				}
+				emit_set(&e, d->rd, RAX);
+			} break;
+			case Kind_Add: case Kind_Addu: case Kind_Sub: {
+				u8 a = emit_get(&e, d->rs, RAX);
+				if (a != RAX) emit_rr(&e, 0x89, RAX, a);
+				u8 c = emit_get(&e, d->rt, RCX);
+				emit_rr(&e, d->kind == Kind_Sub ? 0x29 : 0x01, RAX, c);
+				emit_set(&e, d->rd, RAX);
+			} break;
+			case Kind_Mult: {  emit_mult(&e, d, true); } break;
+			case Kind_Multu: { emit_mult(&e, d, false); } break;
+			case Kind_Addi: case Kind_Addiu: case Kind_Ori: {
+				u8 src = emit_get(&e, d->rs, RAX);
+				u8 dst = e.pin[d->rt] ? e.pin[d->rt] : RAX;
+				if (src != dst) emit_rr(&e, 0x89, dst, src);
+				if (d->imm) emit_ri(&e, d->kind == Kind_Ori ? 1 : 0, dst, d->imm);
+				emit_set(&e, d->rt, dst);
+			} break;
+			case Kind_Lui: {
+				u8 dst = e.pin[d->rt] ? e.pin[d->rt] : RAX;
+				emit_mov_imm(&e, dst, d->imm);
+				emit_set(&e, d->rt, dst);
+			} break;
+			case Kind_Lb: {
+				emit_addr(&e, d);
+				emit_guest_mem(&e, 0x0F, 0xB6, RAX);
+				emit_set(&e, d->rt, RAX);
+			} break;
+			case Kind_Lw: {
+				emit_addr(&e, d);
+				emit_align_check(&e, pc);
+				emit_guest_mem(&e, 0x8B, 0, RAX);
+				emit_set(&e, d->rt, RAX);
+			} break;
+			case Kind_Sb: { emit_store(&e, m, b, d, pc, 1); } break;
+			case Kind_Sw: { emit_store(&e, m, b, d, pc, 4); } break;
+			case Kind_Sync: {
+				// mfence
+				emit8(&e, 0x0F);
+				emit8(&e, 0xAE);
+				emit8(&e, 0xF0);
+			} break;
+			case Kind_Beq: case Kind_Bne: {
+				u8 x = emit_get(&e, d->rs, RAX);
+				u8 y = emit_get(&e, d->rt, RCX);
+				emit_rr(&e, 0x39, x, y);
+				u8 *not_taken = emit_jcc(&e, d->kind == Kind_Beq ? CC_NE : CC_E);
+				emit_exit_to(&e, b, d->imm);
+				patch(not_taken, e.p);
+				emit_exit_to(&e, b, pc + 4);
+			} break;
+			case Kind_J: {
+				emit_exit_to(&e, b, d->imm);
+			} break;
+			case Kind_Jal: {
+				u8 ra = e.pin[31] ? e.pin[31] : RAX;
+				emit_mov_imm(&e, ra, pc + 8);
+				emit_set(&e, 31, ra);
+				emit_exit_to(&e, b, d->imm);
+			} break;
+			case Kind_Jr: {
+				u8 target = emit_get(&e, d->rs, RAX);
+				if (target != RAX) emit_rr(&e, 0x89, RAX, target);
+				emit_writeback(&e);
+				emit_leave(&e, false);
+			} break;
+			case Kind_Chain: {
+				emit_exit_to(&e, b, pc);
+			} break;
+			default: {
+				emit_exit(&e, pc, true);
+			}
+		}
+
+		if (ends_block(d->kind) || d->kind == Kind_Chain) {
+			break;
+		}
+	}
+
+	jit->used += (u32)(e.p - start);
+	__atomic_store_n(&b->native, (JitFn)start, __ATOMIC_RELEASE);
+	return true;
+}
+
+void *jit_worker(void *arg) {
+	Machine *m = (Machine *)arg;
+	Jit *jit = m->jit;
+
+	pthread_mutex_lock(&jit->lock);
+	while (true) {
+		if (jit->head == jit->tail || jit->full) {
+			pthread_cond_wait(&jit->wake, &jit->lock);
+			continue;
+		}
+
+		Block *b = jit->queue[jit->head % JIT_QUEUE_SIZE];
+		jit->head++;
+
+		if (b != NULL) {
+			b->queued = false;
+			jit_compile(m, b);
+		}
+	}
+
+	return NULL;
+}
+
+bool jit_start_tiered(Machine *m) {
+	Jit *jit = m->jit;
+	jit->tiered = true;
+	pthread_mutex_init(&jit->lock, NULL);
+	pthread_cond_init(&jit->wake, NULL);
+
+	if (pthread_create(&jit->thread, NULL, jit_worker, m) != 0) {
+		printf("Failed to start the compiler thread!\n");
+		return false;
+	}
+
+	pthread_detach(jit->thread);
+	return true;
+}
+
+/*
+ * Called when b crosses JIT_THRESHOLD. Compiles it on the spot, or in
+ * tiered mode hands it to the compiler thread without waiting; returns
+ * true only if b->native is ready to run now.
+ */
+bool jit_request(Machine *m, Block *b) {
+	Jit *jit = m->jit;
+	if (!jit->tiered) {
+		return jit_compile(m, b);
+	}
+
+	if (jit->full) {
+		pthread_mutex_lock(&jit->lock);
+		jit_flush(m);
+		jit->full = false;
+		pthread_cond_signal(&jit->wake);
+		pthread_mutex_unlock(&jit->lock);
+		return false;
+	}
+
+	// Never stall the guest on the compiler; try again on a later entry
+	if (b->queued || pthread_mutex_trylock(&jit->lock) != 0) {
+		return false;
+	}
+
+	if (jit->tail - jit->head < JIT_QUEUE_SIZE) {
+		jit->queue[jit->tail % JIT_QUEUE_SIZE] = b;
+		jit->tail++;
+		b->queued = true;
+		pthread_cond_signal(&jit->wake);
+	}
+
+	pthread_mutex_unlock(&jit->lock);
+	return false;
+}
+
+#endif
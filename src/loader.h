@@ -0,0 +1,251 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "elf.h"
+#include "machine.h"
+#include "syscall.h"
+
+/*
+ * Maps a guest binary into host memory so guest address a lives at
+ * m->mem + a. The whole 32-bit guest space is reserved up front, so any
+ * u32 is a valid offset from m->mem and accesses need no bounds check;
+ * whatever isn't mapped stays PROT_NONE and faults (see fault.h). Elf
+ * PT_LOAD segments are mmap'd straight from the file at their vaddr
+ * (MAP_PRIVATE, so guest writes never reach the file) and the space
+ * between file_size and mem_size is zero filled; nothing is read up
+ * front, so load time doesn't depend on the size of the binary.
+ *
+ * A binary already in memory (load_program_buffer) is copied instead.
+ *
+ * Flat binaries are placed at FLAT_BASE, the address asm resolves labels
+ * against. Every segment is mapped writable, since asm puts data and
+ * code in a single R+X segment.
+ */
+
+#define MAX_SEGMENTS 16
+
+#define GUEST_SPACE (1ULL << 32)
+
+// Job inputs are mapped here, with a0 = INPUT_BASE and a1 = their size
+#define INPUT_BASE 0x10000000
+
+// The stack grows down from STACK_TOP, committed a page at a time on use
+#define STACK_TOP 0x7FFF0000
+#define STACK_MAX (8 << 20)
+
+static u64 page_round_up(u64 size, u64 page) {
+	return (size + page - 1) & ~(page - 1);
+}
+
+bool add_region(Machine *m, u32 start, u64 end) {
+	if (m->num_regions == MAX_REGIONS) {
+		return false;
+	}
+
+	m->regions[m->num_regions].start = start;
+	m->regions[m->num_regions].size = end - start;
+	m->num_regions++;
+	return true;
+}
+
+// Maps seg from fd, or copies it out of file when fd is -1
+bool map_segment(Machine *m, int fd, u8 *file, Segment *seg) {
+	u32 page = getpagesize();
+	u32 start = seg->vaddr & ~(page - 1);
+	u64 end = page_round_up((u64)seg->vaddr + seg->mem_size, page);
+	if (end == start || !add_region(m, start, end)) {
+		return end == start;
+	}
+	u32 file_end = seg->vaddr + seg->file_size;
+	int prot = PROT_READ | PROT_WRITE;
+
+	// Only possible when file offset and vaddr agree modulo the page size
+	if (fd >= 0 && seg->file_size > 0 && (seg->vaddr - seg->off) % page == 0) {
+		u64 map_end = page_round_up(file_end, page);
+		u32 map_off = seg->off - (seg->vaddr - start);
+
+		if (mmap(m->mem + start, map_end - start, prot, MAP_PRIVATE | MAP_FIXED, fd, map_off) == MAP_FAILED) {
+			return false;
+		}
+
+		if (seg->mem_size > seg->file_size) {
+			u64 zero_end = seg->vaddr + (u64)seg->mem_size;
+			memset(m->mem + file_end, 0, (map_end < zero_end ? map_end : zero_end) - file_end);
+		}
+
+		if (end > map_end && mmap(m->mem + map_end, end - map_end, prot,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+			return false;
+		}
+
+		return true;
+	}
+
+	if (mmap(m->mem + start, end - start, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+		return false;
+	}
+
+	if (fd < 0) {
+		memcpy(m->mem + seg->vaddr, file + seg->off, seg->file_size);
+	} else if (seg->file_size > 0 && pread(fd, m->mem + seg->vaddr, seg->file_size, seg->off) != seg->file_size) {
+		return false;
+	}
+
+	return true;
+}
+
+// Lays out the binary in file, which fd is open on (or -1 when it's only in memory)
+static bool load_image(Machine *m, u8 *file, u64 size, int fd, char *name) {
+	Segment segs[MAX_SEGMENTS];
+	i32 num_segs;
+	u32 entry;
+
+	if (is_elf(file, size)) {
+		num_segs = read_elf_segments(file, size, segs, MAX_SEGMENTS, &entry);
+		if (num_segs <= 0) {
+			printf("%s: invalid elf file!\n", name);
+			return false;
+		}
+	} else {
+		num_segs = 1;
+		segs[0].off = 0;
+		segs[0].vaddr = FLAT_BASE;
+		segs[0].file_size = size;
+		segs[0].mem_size = size;
+		segs[0].flags = PF_R | PF_W | PF_X;
+		entry = FLAT_BASE;
+	}
+
+	u32 code_lo = 0xFFFFFFFF;
+	u64 code_hi = 0;
+	u64 image_end = 0;
+	for (i32 i = 0; i < num_segs; i++) {
+		u64 seg_end = (u64)segs[i].vaddr + segs[i].mem_size;
+		if (seg_end > image_end) image_end = seg_end;
+		if (segs[i].flags & PF_X) {
+			if (segs[i].vaddr < code_lo) code_lo = segs[i].vaddr;
+			if (seg_end > code_hi) code_hi = seg_end;
+		}
+	}
+
+	m->mem_size = GUEST_SPACE;
+	m->mem = mmap(NULL, m->mem_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m->mem == MAP_FAILED) {
+		printf("Unable to reserve guest memory!\n");
+		m->mem = NULL;
+		return false;
+	}
+
+	for (i32 i = 0; i < num_segs; i++) {
+		if (!map_segment(m, fd, file, &segs[i])) {
+			printf("%s: unable to map segment %d!\n", name, i);
+			munmap(m->mem, m->mem_size);
+			m->mem = NULL;
+			m->num_regions = 0;
+			return false;
+		}
+	}
+
+	if (code_hi <= code_lo) {
+		code_lo = code_hi = 0;
+	}
+
+	m->file = file;
+	m->file_size = size;
+	m->code_base = code_lo & ~3;
+	m->code_size = (code_hi - m->code_base) / 4;
+	m->pc = entry;
+	m->budget = BUDGET_UNLIMITED;
+	m->reg[29] = STACK_TOP;
+	m->stack_low = STACK_TOP;
+	m->sys = sys_init();
+	// The break starts just past the binary
+	m->sys->heap = heap_init(m->mem, m->regions, &m->num_regions, page_round_up(image_end, getpagesize()));
+
+	return true;
+}
+
+bool load_program(Machine *m, char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("%s not found!\n", path);
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0 || st.st_size > 0xFFFFFFFFLL) {
+		printf("%s: invalid binary!\n", path);
+		close(fd);
+		return false;
+	}
+
+	u8 *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (file == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+
+	bool ok = load_image(m, file, st.st_size, fd, path);
+	if (!ok) {
+		munmap(file, st.st_size);
+	}
+	close(fd);
+	return ok;
+}
+
+// Loads a binary from memory; it's copied, so buf can go once this returns
+bool load_program_buffer(Machine *m, void *buf, u64 size) {
+	if (size == 0 || size > 0xFFFFFFFFLL) {
+		printf("Invalid binary!\n");
+		return false;
+	}
+
+	u8 *file = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (file == MAP_FAILED) {
+		return false;
+	}
+	memcpy(file, buf, size);
+	mprotect(file, size, PROT_READ);
+
+	if (!load_image(m, file, size, -1, "buffer")) {
+		munmap(file, size);
+		return false;
+	}
+	return true;
+}
+
+bool load_input(Machine *m, char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("%s not found!\n", path);
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size > STACK_TOP - STACK_MAX - INPUT_BASE) {
+		printf("%s: input too large!\n", path);
+		close(fd);
+		return false;
+	}
+
+	Segment seg = {0, INPUT_BASE, st.st_size, st.st_size, PF_R | PF_W};
+	bool ok = map_segment(m, fd, NULL, &seg);
+	close(fd);
+
+	m->reg[4] = INPUT_BASE;
+	m->reg[5] = st.st_size;
+	return ok;
+}
+
+void unload_program(Machine *m) {
+	sys_free(m->sys);
+	munmap(m->mem, m->mem_size);
+	munmap(m->file, m->file_size);
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include "common.h"
+#include "mips.h"
+
+struct Machine;
+
+// Native code for a block; returns the guest pc to continue at
+typedef u32 (*JitFn)(u32 *reg, u8 *mem, struct Machine *m);
+
+#define BLOCK_MAX_OPS 64
+
+/*
+ * A straight-line run of predecoded ops starting at pc and ending at the
+ * first control transfer or syscall. taken/fall cache the successor
+ * blocks so the dispatcher can jump straight from one block to the next.
+ */
+typedef struct Block {
+	u32 pc;
+	u32 len;
+	struct Block *taken;
+	struct Block *fall;
+	struct Block *next;
+
+	u32 hits;
+	bool no_jit;
+	bool queued;
+	JitFn native;
+
+	Decoded ops[];
+} Block;
+
+/*
+ * Superinstructions: runs of ops common enough in asm output (the lui/ori
+ * pair every address load expands to, and loop tails that bump a counter
+ * or pointers and branch) to get a handler of their own. The group's
+ * first op is bound to it and the handler runs every op of the group
+ * before dispatching again; the other ops keep their own handlers and
+ * their place in the block, so pcs and everything keyed by kind are
+ * unchanged. Only blocks are fused, never m->code, so a jump into the
+ * middle of a group just builds a block starting there.
+ */
+enum {
+	Fuse_None,
+	Fuse_LuiOri,
+	Fuse_AddiuAddiu,
+	Fuse_AddiuBne,
+	Fuse_AddiuBeq,
+	Fuse_AddiuAddiuBne,
+	Fuse_Count
+};
+
+// A page aligned range of guest memory that is mapped in
+typedef struct Region {
+	u32 start;
+	u32 size;
+} Region;
+
+#define MAX_REGIONS 64
+
+// Why run() returned
+enum {
+	Stop_Exit,
+	Stop_Budget,
+	Stop_Yield,
+	Stop_Sleep,
+	// Waiting on host I/O, see Sys_Io
+	Stop_Io,
+	Stop_Fault,
+	// At a syscall, with trap_syscalls set; pc is the syscall itself
+	Stop_Syscall,
+};
+
+#define BUDGET_UNLIMITED INT64_MAX
+
+typedef struct Machine {
+	u32 reg[32];
+	u32 hi;
+	u32 lo;
+	u32 pc;
+
+	// Instructions left before run() stops at a block boundary; a block
+	// runs while any are left, so this can go a few below zero. Only
+	// scheduled machines (sched != NULL) stop for waiting syscalls
+	i64 budget;
+	u8 stop;
+	u64 sleep_us;
+	// For embedders: stop at syscalls rather than running them, and
+	// report faults through stop alone
+	bool trap_syscalls;
+	bool quiet;
+	struct Sched *sched;
+	// Open files and write buffers, shared by every hart
+	struct Sys *sys;
+
+	// Other harts share mem and code; see hart_spawn
+	u32 hart_id;
+	bool spawn_ok;
+	// Reservation left by ll for the next sc
+	u32 ll_addr;
+	u32 ll_value;
+	bool ll_valid;
+
+	// Guest address a lives at mem + a; mem_size bytes are reserved there
+	u8 *mem;
+	u64 mem_size;
+
+	Region regions[MAX_REGIONS];
+	u32 num_regions;
+	// Lowest stack page committed so far
+	u32 stack_low;
+
+	// The binary as mapped from disk
+	u8 *file;
+	u64 file_size;
+
+	// Predecoded words of the executable segments, from code_base up;
+	// code_shared means other machines use the same copy, see code_own()
+	Decoded *code;
+	bool code_shared;
+	u32 code_base;
+	u32 code_size;
+
+	Block **blocks;
+	Block *block_list;
+	u8 *in_block;
+	// Bumped whenever a store rewrites decoded text
+	u32 code_writes;
+
+	struct Jit *jit;
+	u8 jit_bail;
+
+	struct Trace *trace;
+	struct Profile *profile;
+	struct Flame *flame;
+	struct CacheSim *cachesim;
+	struct Timing *timing;
+	struct Fuzz *fuzz;
+} Machine;
+
+static inline bool in_code(Machine *m, u32 addr) {
+	return addr - m->code_base < m->code_size * 4;
+}
+
+bool code_written(Machine *m, u32 addr, u32 width, Block *cur);
+void code_reset(Machine *m);
+u32 hart_spawn(Machine *m, u32 pc, u32 sp, u32 arg);
+int run_guest(int (*run)(Machine *), Machine *m);
+
+#endif
@@ -0,0 +1,203 @@
+#ifndef MIPS_H
+#define MIPS_H
+
+#include <arpa/inet.h>
+#include "common.h"
+
+// Primary opcode field, bits 31..26
+#define OP_SPECIAL 0x00
+#define OP_J       0x02
+#define OP_JAL     0x03
+#define OP_BEQ     0x04
+#define OP_BNE     0x05
+#define OP_ADDI    0x08
+#define OP_ADDIU   0x09
+#define OP_ORI     0x0D
+#define OP_LUI     0x0F
+#define OP_LB      0x20
+#define OP_LW      0x23
+#define OP_SB      0x28
+#define OP_SW      0x2B
+#define OP_LL      0x30
+#define OP_SC      0x38
+
+// SPECIAL function field, bits 5..0
+#define FN_SLL     0x00
+#define FN_JR      0x08
+#define FN_SYSCALL 0x0C
+#define FN_SYNC    0x0F
+#define FN_MULT    0x18
+#define FN_MULTU   0x19
+#define FN_ADD     0x20
+#define FN_ADDU    0x21
+#define FN_SUB     0x22
+
+typedef enum Kind {
+	Kind_Nop, Kind_Sll,
+	Kind_Jr, Kind_Syscall,
+	Kind_Mult, Kind_Multu,
+	Kind_Add, Kind_Addu,
+	Kind_Sub, Kind_J,
+	Kind_Jal, Kind_Beq,
+	Kind_Bne, Kind_Addi,
+	Kind_Addiu, Kind_Ori,
+	Kind_Lui, Kind_Lb,
+	Kind_Lw, Kind_Sb,
+	Kind_Sw, Kind_Ll,
+	Kind_Sc, Kind_Sync,
+	Kind_Illegal,
+	Kind_End, Kind_Chain,
+	Kind_Count
+} Kind;
+
+/*
+ * One predecoded instruction. Every field the handlers need is pulled out
+ * of the raw word once, so the hot loop never shifts or byte-swaps.
+ * imm holds the sign/zero extended immediate, or the absolute target
+ * for branches and jumps.
+ */
+typedef struct Decoded {
+	void *handler;
+	u32 op;
+	u32 imm;
+	u8 kind;
+	u8 rs;
+	u8 rt;
+	u8 rd;
+	u8 sa;
+} Decoded;
+
+u32 fetch_op(u8 *mem, u32 addr) {
+	u32 op;
+	memcpy(&op, mem + addr, sizeof(op));
+	return ntohl(op);
+}
+
+void decode_op(u32 op, u32 pc, Decoded *d) {
+	memset(d, 0, sizeof(Decoded));
+
+	u8 op_id = op >> 26;
+	u8 special_op_id = op & 0x3F;
+
+	d->op = op;
+	d->rs = (op >> 21) & 0x1F;
+	d->rt = (op >> 16) & 0x1F;
+	d->rd = (op >> 11) & 0x1F;
+	d->sa = (op >> 6) & 0x1F;
+	d->imm = op & 0xFFFF;
+	d->kind = Kind_Illegal;
+
+	u32 simm = (u32)(i32)(i16)(op & 0xFFFF);
+
+	switch (op_id) {
+		case OP_SPECIAL: {
+			switch (special_op_id) {
+				case FN_SLL: {     d->kind = (op == 0) ? Kind_Nop : Kind_Sll; } break;
+				case FN_JR: {      d->kind = Kind_Jr; } break;
+				case FN_SYSCALL: { d->kind = Kind_Syscall; } break;
+				case FN_SYNC: {    d->kind = Kind_Sync; } break;
+				case FN_MULT: {    d->kind = Kind_Mult; } break;
+				case FN_MULTU: {   d->kind = Kind_Multu; } break;
+				case FN_ADD: {     d->kind = Kind_Add; } break;
+				case FN_ADDU: {    d->kind = Kind_Addu; } break;
+				case FN_SUB: {     d->kind = Kind_Sub; } break;
+				default: {}
+			}
+		} break;
+		case OP_J: {     d->kind = Kind_J;   d->imm = (pc & 0xF0000000) | (op & 0x03FFFFFF); } break;
+		case OP_JAL: {   d->kind = Kind_Jal; d->imm = (pc & 0xF0000000) | (op & 0x03FFFFFF); } break;
+		case OP_BEQ: {   d->kind = Kind_Beq; d->imm = pc + 4 + (simm << 2); } break;
+		case OP_BNE: {   d->kind = Kind_Bne; d->imm = pc + 4 + (simm << 2); } break;
+		case OP_ADDI: {  d->kind = Kind_Addi;  d->imm = simm; } break;
+		case OP_ADDIU: { d->kind = Kind_Addiu; d->imm = simm; } break;
+		case OP_ORI: {   d->kind = Kind_Ori; } break;
+		case OP_LUI: {   d->kind = Kind_Lui; d->imm = (op & 0xFFFF) << 16; } break;
+		case OP_LB: {    d->kind = Kind_Lb; d->imm = simm; } break;
+		case OP_LW: {    d->kind = Kind_Lw; d->imm = simm; } break;
+		case OP_SB: {    d->kind = Kind_Sb; d->imm = simm; } break;
+		case OP_SW: {    d->kind = Kind_Sw; d->imm = simm; } break;
+		case OP_LL: {    d->kind = Kind_Ll; d->imm = simm; } break;
+		case OP_SC: {    d->kind = Kind_Sc; d->imm = simm; } break;
+		default: {}
+	}
+
+	// Writes to r0 are architecturally discarded, so drop them here
+	// instead of re-zeroing the register after every instruction
+	switch (d->kind) {
+		case Kind_Sll: case Kind_Add: case Kind_Addu: case Kind_Sub: {
+			if (d->rd == 0) d->kind = Kind_Nop;
+		} break;
+		case Kind_Addi: case Kind_Addiu: case Kind_Ori: case Kind_Lui:
+		case Kind_Lb: case Kind_Lw: {
+			if (d->rt == 0) d->kind = Kind_Nop;
+		} break;
+		default: {}
+	}
+}
+
+// Renders d the way the old per-instruction log printed it
+void disasm(Decoded *d, char *buf, u32 size) {
+	switch (d->kind) {
+		case Kind_Nop: {     snprintf(buf, size, "nop"); } break;
+		case Kind_Sll: {     snprintf(buf, size, "sll r%u, r%u, %u", d->rd, d->rt, d->sa); } break;
+		case Kind_Jr: {      snprintf(buf, size, "jr r%u", d->rs); } break;
+		case Kind_Syscall: { snprintf(buf, size, "syscall"); } break;
+		case Kind_Mult: {    snprintf(buf, size, "mult r%u, r%u", d->rs, d->rt); } break;
+		case Kind_Multu: {   snprintf(buf, size, "multu r%u, r%u", d->rs, d->rt); } break;
+		case Kind_Add: {     snprintf(buf, size, "add r%u, r%u, r%u", d->rd, d->rs, d->rt); } break;
+		case Kind_Addu: {    snprintf(buf, size, "addu r%u, r%u, r%u", d->rd, d->rs, d->rt); } break;
+		case Kind_Sub: {     snprintf(buf, size, "sub r%u, r%u, r%u", d->rd, d->rs, d->rt); } break;
+		case Kind_J: {       snprintf(buf, size, "j 0x%x", d->imm); } break;
+		case Kind_Jal: {     snprintf(buf, size, "jal 0x%x", d->imm); } break;
+		case Kind_Beq: {     snprintf(buf, size, "beq r%u, r%u, 0x%x", d->rs, d->rt, d->imm); } break;
+		case Kind_Bne: {     snprintf(buf, size, "bne r%u, r%u, 0x%x", d->rs, d->rt, d->imm); } break;
+		case Kind_Addi: {    snprintf(buf, size, "addi r%u, r%u, 0x%x", d->rt, d->rs, d->imm); } break;
+		case Kind_Addiu: {   snprintf(buf, size, "addiu r%u, r%u, 0x%x", d->rt, d->rs, d->imm); } break;
+		case Kind_Ori: {     snprintf(buf, size, "ori r%u, r%u, 0x%x", d->rt, d->rs, d->imm); } break;
+		case Kind_Lui: {     snprintf(buf, size, "lui r%u, 0x%x", d->rt, d->imm >> 16); } break;
+		case Kind_Lb: {      snprintf(buf, size, "lb r%u, [r%u + %d]", d->rt, d->rs, (i32)d->imm); } break;
+		case Kind_Lw: {      snprintf(buf, size, "lw r%u, [r%u + %d]", d->rt, d->rs, (i32)d->imm); } break;
+		case Kind_Sb: {      snprintf(buf, size, "sb r%u, [r%u + %d]", d->rt, d->rs, (i32)d->imm); } break;
+		case Kind_Sw: {      snprintf(buf, size, "sw r%u, [r%u + %d]", d->rt, d->rs, (i32)d->imm); } break;
+		case Kind_Ll: {      snprintf(buf, size, "ll r%u, [r%u + %d]", d->rt, d->rs, (i32)d->imm); } break;
+		case Kind_Sc: {      snprintf(buf, size, "sc r%u, [r%u + %d]", d->rt, d->rs, (i32)d->imm); } break;
+		case Kind_Sync: {    snprintf(buf, size, "sync"); } break;
+		default: {           snprintf(buf, size, "illegal 0x%08x", d->op); }
+	}
+}
+
+const char *kind_name(u8 kind) {
+	static const char *names[Kind_Count] = {
+		[Kind_Nop] = "nop",         [Kind_Sll] = "sll",
+		[Kind_Jr] = "jr",           [Kind_Syscall] = "syscall",
+		[Kind_Mult] = "mult",       [Kind_Multu] = "multu",
+		[Kind_Add] = "add",         [Kind_Addu] = "addu",
+		[Kind_Sub] = "sub",         [Kind_J] = "j",
+		[Kind_Jal] = "jal",         [Kind_Beq] = "beq",
+		[Kind_Bne] = "bne",         [Kind_Addi] = "addi",
+		[Kind_Addiu] = "addiu",     [Kind_Ori] = "ori",
+		[Kind_Lui] = "lui",         [Kind_Lb] = "lb",
+		[Kind_Lw] = "lw",           [Kind_Sb] = "sb",
+		[Kind_Sw] = "sw",           [Kind_Ll] = "ll",
+		[Kind_Sc] = "sc",           [Kind_Sync] = "sync",
+		[Kind_Illegal] = "illegal",
+		[Kind_End] = "end",         [Kind_Chain] = "chain",
+	};
+	return kind < Kind_Count ? names[kind] : "illegal";
+}
+
+bool ends_block(u8 kind) {
+	switch (kind) {
+		case Kind_Jr: case Kind_Syscall:
+		case Kind_J: case Kind_Jal:
+		case Kind_Beq: case Kind_Bne:
+		case Kind_Illegal: case Kind_End: {
+			return true;
+		} break;
+		default: {
+			return false;
+		}
+	}
+}
+
+#endif
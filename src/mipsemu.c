@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "emulator.h"
+#include "mipsemu.h"
+
+/*
+ * libmipsemu, see mipsemu.h. Built on its own into libmipsemu.a:
+ *   clang -O3 -pthread -c src/mipsemu.c -o mipsemu.o && ar rcs libmipsemu.a mipsemu.o
+ */
+
+struct MipsEmu {
+	Machine m;
+	Snapshot *snap;
+	int status;
+	u32 fault_addr;
+	u64 instructions;
+};
+
+static pthread_once_t mipsemu_once = PTHREAD_ONCE_INIT;
+
+static void mipsemu_init() {
+	run_fast(NULL);
+	fault_init();
+}
+
+MipsEmu *mipsemu_new(const void *image, size_t size) {
+	pthread_once(&mipsemu_once, mipsemu_init);
+
+	MipsEmu *e = (MipsEmu *)calloc(1, sizeof(MipsEmu));
+	Machine *m = &e->m;
+	if (!load_program_buffer(m, (void *)image, size)) {
+		free(e);
+		return NULL;
+	}
+	m->quiet = true;
+	predecode(m, NULL);
+
+	e->snap = snapshot_take(m);
+	if (e->snap == NULL) {
+		mipsemu_free(e);
+		return NULL;
+	}
+	return e;
+}
+
+void mipsemu_free(MipsEmu *e) {
+	if (e->snap != NULL) {
+		snapshot_free(e->snap);
+	}
+	blocks_free(&e->m);
+	free(e->m.code);
+	unload_program(&e->m);
+	free(e);
+}
+
+MipsEmuStop mipsemu_run(MipsEmu *e, uint64_t instructions) {
+	Machine *m = &e->m;
+	i64 budget = instructions == 0 || instructions > BUDGET_UNLIMITED ? BUDGET_UNLIMITED : (i64)instructions;
+	int status;
+	e->instructions += run_budget(run_fast, m, budget, &status);
+
+	switch (m->stop) {
+		case Stop_Budget: {
+			return MIPSEMU_BUDGET;
+		} break;
+		case Stop_Syscall: {
+			return MIPSEMU_SYSCALL;
+		} break;
+		case Stop_Fault: {
+			e->fault_addr = fault_addr;
+			return MIPSEMU_FAULT;
+		} break;
+		default: {
+			e->status = status;
+			return MIPSEMU_EXIT;
+		}
+	}
+}
+
+void mipsemu_trap_syscalls(MipsEmu *e, bool trap) {
+	e->m.trap_syscalls = trap;
+}
+
+bool mipsemu_syscall(MipsEmu *e) {
+	Machine *m = &e->m;
+	u32 action = syscall_exec(m->sys, m->reg, m->mem);
+	if (action == Sys_Exit) {
+		e->status = m->reg[4];
+		return true;
+	}
+
+	if (action == Sys_Spawn) {
+		m->reg[2] = -1;
+	}
+	sys_wait(action, m->reg, m->mem);
+	m->pc += 4;
+	return false;
+}
+
+int mipsemu_status(MipsEmu *e) {
+	return e->status;
+}
+
+uint32_t mipsemu_fault_addr(MipsEmu *e) {
+	return e->fault_addr;
+}
+
+uint64_t mipsemu_instructions(MipsEmu *e) {
+	return e->instructions;
+}
+
+uint32_t mipsemu_reg(MipsEmu *e, unsigned r) {
+	return r < 32 ? e->m.reg[r] : 0;
+}
+
+void mipsemu_set_reg(MipsEmu *e, unsigned r, uint32_t value) {
+	if (r > 0 && r < 32) {
+		e->m.reg[r] = value;
+	}
+}
+
+uint32_t mipsemu_pc(MipsEmu *e) {
+	return e->m.pc;
+}
+
+void mipsemu_set_pc(MipsEmu *e, uint32_t pc) {
+	e->m.pc = pc;
+}
+
+// memcpy with guest faults caught, as in run_guest
+static bool mipsemu_copy(Machine *m, void *dst, const void *src, size_t len) {
+	sigjmp_buf env;
+	if (sigsetjmp(env, 1)) {
+		fault_env = NULL;
+		return false;
+	}
+
+	fault_machine = m;
+	fault_env = &env;
+	// Keeps the compiler from moving the copy out from between the two
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	memcpy(dst, src, len);
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	fault_env = NULL;
+	return true;
+}
+
+bool mipsemu_read(MipsEmu *e, uint32_t addr, void *dst, size_t len) {
+	if ((u64)addr + len > GUEST_SPACE) {
+		return false;
+	}
+	return mipsemu_copy(&e->m, dst, e->m.mem + addr, len);
+}
+
+bool mipsemu_write(MipsEmu *e, uint32_t addr, const void *src, size_t len) {
+	Machine *m = &e->m;
+	if ((u64)addr + len > GUEST_SPACE || !mipsemu_copy(m, m->mem + addr, src, len)) {
+		return false;
+	}
+
+	// Decoded text has to follow, as for a guest store
+	u64 lo = addr > m->code_base ? addr : m->code_base;
+	u64 hi = (u64)addr + len;
+	u64 code_end = m->code_base + (u64)m->code_size * 4;
+	if (hi > code_end) {
+		hi = code_end;
+	}
+	if (lo < hi) {
+		code_written(m, lo, hi - lo, NULL);
+	}
+	return true;
+}
+
+void mipsemu_set_input(MipsEmu *e, const void *data, size_t len) {
+	Sys *s = e->m.sys;
+	s->input = (u8 *)data;
+	s->input_len = len;
+	s->input_pos = 0;
+}
+
+bool mipsemu_snapshot(MipsEmu *e) {
+	Snapshot *snap = snapshot_take(&e->m);
+	if (snap == NULL) {
+		return false;
+	}
+
+	snapshot_free(e->snap);
+	e->snap = snap;
+	sys_keep(e->m.sys);
+	return true;
+}
+
+bool mipsemu_reset(MipsEmu *e) {
+	Machine *m = &e->m;
+	// sys_reset closes the files the guest opened, and drops its input too
+	u8 *input = m->sys->input;
+	u32 input_len = m->sys->input_len;
+	sys_reset(m->sys);
+	m->sys->input = input;
+	m->sys->input_len = input_len;
+	e->status = 0;
+	e->instructions = 0;
+	return snapshot_restore(m, e->snap);
+}
@@ -0,0 +1,78 @@
+#ifndef MIPSEMU_H
+#define MIPSEMU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libmipsemu: the emulator as a library, for running many guests in one
+ * process without paying for fork, exec and loading each time.
+ *
+ * A MipsEmu is one guest, loaded from an elf or flat binary in memory.
+ * It runs on the interpreter for a number of instructions at a time, or
+ * until it exits, faults or (with mipsemu_trap_syscalls) reaches a
+ * syscall. Nothing ever calls exit(): how a run ended is what
+ * mipsemu_run returns. mipsemu_reset puts the guest back the way it was
+ * when loaded (or at the last mipsemu_snapshot), copy-on-write, so
+ * resetting costs the pages the guest touched rather than its size. Files
+ * the guest opened since are closed, and its input is read from the start.
+ *
+ * Guest faults are caught with a SIGSEGV handler the first mipsemu_new
+ * installs; faults that aren't in a guest go on to whatever handler was
+ * there before. Different MipsEmus can run on different threads at
+ * once, but each one on only one thread at a time. Guests can't start
+ * harts.
+ */
+
+typedef struct MipsEmu MipsEmu;
+
+typedef enum MipsEmuStop {
+	// Ran the instructions it was given; run it again to carry on
+	MIPSEMU_BUDGET,
+	// Exited, with mipsemu_status
+	MIPSEMU_EXIT,
+	// At a syscall, which hasn't run yet: see mipsemu_syscall
+	MIPSEMU_SYSCALL,
+	// Touched unmapped memory or made an unaligned access, at
+	// mipsemu_fault_addr, or ran an unknown instruction at that pc
+	MIPSEMU_FAULT,
+} MipsEmuStop;
+
+// Loads a guest from the binary in image, which is copied; NULL if it isn't one
+MipsEmu *mipsemu_new(const void *image, size_t size);
+void mipsemu_free(MipsEmu *e);
+
+/*
+ * Runs for instructions instructions (0 for no limit). The count is
+ * checked a block at a time, so a run can go a few past it.
+ */
+MipsEmuStop mipsemu_run(MipsEmu *e, uint64_t instructions);
+
+// Whether runs stop at syscalls instead of running them
+void mipsemu_trap_syscalls(MipsEmu *e, bool trap);
+// Runs the syscall the guest stopped at as emu would and moves past it; true if it was exit
+bool mipsemu_syscall(MipsEmu *e);
+
+int mipsemu_status(MipsEmu *e);
+uint32_t mipsemu_fault_addr(MipsEmu *e);
+// Instructions run since the guest was loaded or last reset, counted a block at a time
+uint64_t mipsemu_instructions(MipsEmu *e);
+
+uint32_t mipsemu_reg(MipsEmu *e, unsigned r);
+void mipsemu_set_reg(MipsEmu *e, unsigned r, uint32_t value);
+uint32_t mipsemu_pc(MipsEmu *e);
+void mipsemu_set_pc(MipsEmu *e, uint32_t pc);
+
+// Copy guest memory in and out; false if any of it isn't mapped
+bool mipsemu_read(MipsEmu *e, uint32_t addr, void *dst, size_t len);
+bool mipsemu_write(MipsEmu *e, uint32_t addr, const void *src, size_t len);
+
+// What reads of fd 0 get, instead of the host's stdin; data has to outlive the runs
+void mipsemu_set_input(MipsEmu *e, const void *data, size_t len);
+
+// Makes the guest as it is now what mipsemu_reset goes back to
+bool mipsemu_snapshot(MipsEmu *e);
+bool mipsemu_reset(MipsEmu *e);
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "common.h"
+#include "mips.h"
+#include "machine.h"
+
+/*
+ * Execution profile, collected through the interpreter's hooks. The
+ * counters are flat arrays indexed by a word's offset into the text, and
+ * only two things are counted as the guest runs: entering a block, on its
+ * first word, and taking a branch. Everything else is worked out at exit:
+ * a word's hits are the entries of the blocks covering it, less the times
+ * a block stopped before reaching it (see profile_cut), and the opcode
+ * mix and load, store and branch totals come from the hits and the
+ * decoded text (so text the guest rewrote counts as what it ended up
+ * as). A block the guest dies in part way through (a fault, an unaligned
+ * access) is counted as having run to its end.
+ * The profile is summarised on stderr and written out in full as JSON.
+ */
+
+#define PROFILE_TOP_PCS 20
+#define PROFILE_TOP_BLOCKS 10
+
+typedef struct Profile {
+	u32 code_base;
+	u32 code_size;
+
+	// Per word of text
+	u64 *entries;
+	u32 *lens;
+	u64 *cuts;
+	u64 *taken;
+	// The block entered last
+	u32 cur;
+
+	// Filled in by profile_sum
+	u64 *hits;
+	u64 kinds[Kind_Count];
+	u64 total;
+	u64 loads;
+	u64 stores;
+	u64 branches_taken;
+	u64 branches_not_taken;
+} Profile;
+
+Profile *profile_init(Machine *m) {
+	Profile *p = (Profile *)calloc(1, sizeof(Profile));
+	p->code_base = m->code_base;
+	p->code_size = m->code_size;
+	p->entries = (u64 *)calloc(m->code_size + 1, sizeof(u64));
+	p->lens = (u32 *)calloc(m->code_size + 1, sizeof(u32));
+	p->cuts = (u64 *)calloc(m->code_size + 1, sizeof(u64));
+	p->taken = (u64 *)calloc(m->code_size + 1, sizeof(u64));
+	p->hits = (u64 *)calloc(m->code_size + 1, sizeof(u64));
+	return p;
+}
+
+static inline void profile_enter(Profile *p, u32 idx, u32 len) {
+	p->entries[idx]++;
+	p->lens[idx] = len;
+	p->cur = idx;
+}
+
+// The block entered last stopped at idx, without running it or the rest
+void profile_cut(Profile *p, u32 idx) {
+	for (u32 i = idx; i < p->cur + p->lens[p->cur]; i++) {
+		p->cuts[i]++;
+	}
+}
+
+static void profile_sum(Profile *p, Machine *m) {
+	memset(p->hits, 0, (p->code_size + 1) * sizeof(u64));
+	for (u32 i = 0; i <= p->code_size; i++) {
+		for (u32 j = 0; p->entries[i] != 0 && j < p->lens[i]; j++) {
+			p->hits[i + j] += p->entries[i];
+		}
+	}
+	for (u32 i = 0; i <= p->code_size; i++) {
+		p->hits[i] -= p->cuts[i];
+	}
+
+	memset(p->kinds, 0, sizeof(p->kinds));
+	p->total = p->loads = p->stores = p->branches_taken = p->branches_not_taken = 0;
+
+	for (u32 i = 0; i < p->code_size; i++) {
+		u64 hits = p->hits[i];
+		u8 kind = m->code[i].kind;
+		p->kinds[kind] += hits;
+		p->total += hits;
+
+		switch (kind) {
+			case Kind_Lb: case Kind_Lw: case Kind_Ll: {
+				p->loads += hits;
+			} break;
+			case Kind_Sb: case Kind_Sw: case Kind_Sc: {
+				p->stores += hits;
+			} break;
+			case Kind_Beq: case Kind_Bne: {
+				p->branches_taken += p->taken[i];
+				p->branches_not_taken += hits - p->taken[i];
+			} break;
+			default: {}
+		}
+	}
+}
+
+static int profile_by_count(const void *a, const void *b, void *counts) {
+	u64 ca = ((u64 *)counts)[*(u32 *)a];
+	u64 cb = ((u64 *)counts)[*(u32 *)b];
+	if (ca != cb) {
+		return ca < cb ? 1 : -1;
+	}
+	return *(u32 *)a < *(u32 *)b ? -1 : 1;
+}
+
+// Indices of the nonzero entries of counts, most frequent first
+static u32 profile_sorted(u64 *counts, u32 size, u32 *out) {
+	u32 n = 0;
+	for (u32 i = 0; i < size; i++) {
+		if (counts[i] != 0) {
+			out[n++] = i;
+		}
+	}
+
+	qsort_r(out, n, sizeof(u32), profile_by_count, counts);
+	return n;
+}
+
+// A block's instructions, assuming each entry ran it to the end
+static u64 *profile_block_ops(Profile *p, Machine *m) {
+	u64 *ops = (u64 *)calloc(p->code_size + 1, sizeof(u64));
+	for (Block *b = m->block_list; b != NULL; b = b->next) {
+		u32 idx = (b->pc - p->code_base) / 4;
+		ops[idx] = p->entries[idx] * b->len;
+	}
+	return ops;
+}
+
+void profile_report(Profile *p, Machine *m, FILE *out) {
+	profile_sum(p, m);
+	u64 branches = p->branches_taken + p->branches_not_taken;
+	fprintf(out, "%lu instructions, %lu loads, %lu stores, %lu branches (%.1f%% taken)\n",
+		p->total, p->loads, p->stores, branches, branches ? 100.0 * p->branches_taken / branches : 0.0);
+
+	u32 kinds[Kind_Count];
+	u32 num_kinds = profile_sorted(p->kinds, Kind_Count, kinds);
+	fprintf(out, "\nopcode mix:\n");
+	for (u32 i = 0; i < num_kinds; i++) {
+		u64 count = p->kinds[kinds[i]];
+		fprintf(out, "  %-8s %12lu  %5.1f%%\n", kind_name(kinds[i]), count, 100.0 * count / p->total);
+	}
+
+	u32 *order = (u32 *)malloc((p->code_size + 1) * sizeof(u32));
+	u32 n = profile_sorted(p->hits, p->code_size + 1, order);
+	fprintf(out, "\nhottest instructions:\n");
+	for (u32 i = 0; i < n && i < PROFILE_TOP_PCS; i++) {
+		u32 idx = order[i];
+		char text[64];
+		disasm(&m->code[idx], text, sizeof(text));
+		fprintf(out, "  %08x %12lu  %5.1f%%  %s", p->code_base + idx * 4, p->hits[idx],
+			100.0 * p->hits[idx] / p->total, text);
+		if (m->code[idx].kind == Kind_Beq || m->code[idx].kind == Kind_Bne) {
+			fprintf(out, "  (%.1f%% taken)", 100.0 * p->taken[idx] / p->hits[idx]);
+		}
+		fprintf(out, "\n");
+	}
+
+	u64 *block_ops = profile_block_ops(p, m);
+	n = profile_sorted(block_ops, p->code_size + 1, order);
+	fprintf(out, "\nhottest blocks:\n");
+	for (u32 i = 0; i < n && i < PROFILE_TOP_BLOCKS; i++) {
+		u32 idx = order[i];
+		fprintf(out, "  %08x %12lu entries  %5.1f%% of instructions\n", p->code_base + idx * 4,
+			p->entries[idx], 100.0 * block_ops[idx] / p->total);
+	}
+
+	free(block_ops);
+	free(order);
+}
+
+bool profile_write_json(Profile *p, Machine *m, char *path) {
+	FILE *out = fopen(path, "w");
+	if (out == NULL) {
+		printf("Unable to open profile file %s!\n", path);
+		return false;
+	}
+	profile_sum(p, m);
+
+	fprintf(out, "{\n\t\"instructions\": %lu,\n\t\"loads\": %lu,\n\t\"stores\": %lu,\n", p->total, p->loads, p->stores);
+	fprintf(out, "\t\"branches_taken\": %lu,\n\t\"branches_not_taken\": %lu,\n", p->branches_taken, p->branches_not_taken);
+
+	fprintf(out, "\t\"opcodes\": {");
+	bool first = true;
+	for (u32 i = 0; i < Kind_Count; i++) {
+		if (p->kinds[i] != 0) {
+			fprintf(out, "%s\n\t\t\"%s\": %lu", first ? "" : ",", kind_name(i), p->kinds[i]);
+			first = false;
+		}
+	}
+	fprintf(out, "\n\t},\n");
+
+	fprintf(out, "\t\"pcs\": [");
+	first = true;
+	for (u32 i = 0; i <= p->code_size; i++) {
+		if (p->hits[i] != 0) {
+			fprintf(out, "%s\n\t\t{\"pc\": %u, \"op\": \"%s\", \"hits\": %lu", first ? "" : ",",
+				p->code_base + i * 4, kind_name(m->code[i].kind), p->hits[i]);
+			if (m->code[i].kind == Kind_Beq || m->code[i].kind == Kind_Bne) {
+				fprintf(out, ", \"taken\": %lu", p->taken[i]);
+			}
+			fprintf(out, "}");
+			first = false;
+		}
+	}
+	fprintf(out, "\n\t],\n");
+
+	fprintf(out, "\t\"blocks\": [");
+	first = true;
+	for (Block *b = m->block_list; b != NULL; b = b->next) {
+		u32 idx = (b->pc - p->code_base) / 4;
+		if (p->entries[idx] != 0) {
+			fprintf(out, "%s\n\t\t{\"pc\": %u, \"len\": %u, \"entries\": %lu}", first ? "" : ",",
+				b->pc, b->len, p->entries[idx]);
+			first = false;
+		}
+	}
+	fprintf(out, "\n\t]\n}\n");
+
+	fclose(out);
+	return true;
+}
+
+void profile_free(Profile *p) {
+	free(p->entries);
+	free(p->lens);
+	free(p->cuts);
+	free(p->taken);
+	free(p->hits);
+	free(p);
+}
+
+#endif
@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "file.h"
+#include "elf.h"
+#include "mips.h"
+
+/*
+ * Static recompiler: turns a flat or elf binary from asm into a C file
+ * that builds against src/runtime.h and links with src/runtime.c, which
+ * loads the binary (embedded in the C) as emu would. Every instruction reachable from the
+ * entry point is translated once; each basic block becomes a label in
+ * guest_run() and jr goes through a switch over all block addresses.
+ * Stores into code are not retranslated, so self-modifying guests need emu.
+ */
+
+#define MAX_SEGMENTS 16
+
+typedef struct Image {
+	u8 *bytes;
+	u32 base;
+	u32 size;
+	u32 entry;
+	u8 *exec;
+} Image;
+
+bool load_image(File *f, Image *img) {
+	u8 *bin = (u8 *)f->string;
+
+	if (!is_elf(bin, f->size)) {
+		img->bytes = bin;
+		img->base = FLAT_BASE;
+		img->size = f->size;
+		img->entry = FLAT_BASE;
+		img->exec = (u8 *)malloc(img->size / 4 + 1);
+		memset(img->exec, 1, img->size / 4 + 1);
+		return true;
+	}
+
+	Segment segs[MAX_SEGMENTS];
+	i32 num_segs = read_elf_segments(bin, f->size, segs, MAX_SEGMENTS, &img->entry);
+	if (num_segs <= 0) {
+		printf("%s: invalid elf file!\n", f->filename);
+		return false;
+	}
+
+	u32 lo = 0xFFFFFFFF;
+	u32 hi = 0;
+	for (i32 i = 0; i < num_segs; i++) {
+		if (segs[i].vaddr < lo) lo = segs[i].vaddr;
+		if (segs[i].vaddr + segs[i].mem_size > hi) hi = segs[i].vaddr + segs[i].mem_size;
+	}
+
+	img->base = lo;
+	img->size = hi - lo;
+	img->bytes = (u8 *)calloc(1, img->size);
+	img->exec = (u8 *)calloc(1, img->size / 4 + 1);
+
+	for (i32 i = 0; i < num_segs; i++) {
+		Segment *seg = &segs[i];
+		memcpy(img->bytes + seg->vaddr - lo, bin + seg->off, seg->file_size);
+
+		if (seg->flags & PF_X) {
+			memset(img->exec + (seg->vaddr - lo) / 4, 1, seg->mem_size / 4);
+		}
+	}
+
+	return true;
+}
+
+char *reg_name(u8 r) {
+	static char names[32][4];
+	if (r == 0) {
+		return "0";
+	}
+
+	sprintf(names[r], "r%u", r);
+	return names[r];
+}
+
+void emit_goto(FILE *out, Image *img, u32 target) {
+	u32 idx = (target - img->base) / 4;
+	if ((target & 3) || target < img->base || idx >= img->size / 4 || !img->exec[idx]) {
+		fprintf(out, "return 0;");
+	} else {
+		fprintf(out, "goto L_%08x;", target);
+	}
+}
+
+void emit_op(FILE *out, Image *img, Decoded *d, u32 pc) {
+	char *rs = reg_name(d->rs);
+	char *rt = reg_name(d->rt);
+	char *rd = reg_name(d->rd);
+
+	fprintf(out, "\t");
+	switch (d->kind) {
+		case Kind_Nop: {     fprintf(out, ";"); } break;
+		case Kind_Sll: {     fprintf(out, "%s = %s << %u;", rd, rt, d->sa); } break;
+		case Kind_Add:
+		case Kind_Addu: {    fprintf(out, "%s = %s + %s;", rd, rs, rt); } break;
+		case Kind_Sub: {     fprintf(out, "%s = %s - %s;", rd, rs, rt); } break;
+		case Kind_Mult: {
+			fprintf(out, "{ i64 p = (i64)(i32)%s * (i64)(i32)%s; hi = (u64)p >> 32; lo = (u32)p; }", rs, rt);
+		} break;
+		case Kind_Multu: {
+			fprintf(out, "{ u64 p = (u64)%s * (u64)%s; hi = p >> 32; lo = (u32)p; }", rs, rt);
+		} break;
+		case Kind_Addi:
+		case Kind_Addiu: {   fprintf(out, "%s = %s + 0x%xu;", rt, rs, d->imm); } break;
+		case Kind_Ori: {     fprintf(out, "%s = %s | 0x%xu;", rt, rs, d->imm); } break;
+		case Kind_Lui: {     fprintf(out, "%s = 0x%xu;", rt, d->imm); } break;
+		case Kind_Lb: {      fprintf(out, "%s = *MEM(%s + 0x%xu);", rt, rs, d->imm); } break;
+		case Kind_Lw: {
+			fprintf(out, "{ u32 a = %s + 0x%xu; ALIGNED(a); memcpy(&%s, MEM(a), 4); }", rs, d->imm, rt);
+		} break;
+		case Kind_Sb: {      fprintf(out, "*MEM(%s + 0x%xu) = (u8)%s;", rs, d->imm, rt); } break;
+		case Kind_Sw: {
+			fprintf(out, "{ u32 a = %s + 0x%xu; u32 v = %s; ALIGNED(a); memcpy(MEM(a), &v, 4); }", rs, d->imm, rt);
+		} break;
+		// There is only ever one hart here, so sc always succeeds
+		case Kind_Ll: {
+			fprintf(out, "{ u32 a = %s + 0x%xu; u32 v; ALIGNED(a); memcpy(&v, MEM(a), 4);", rs, d->imm);
+			fprintf(out, d->rt ? " %s = v; }" : " (void)v; }", rt);
+		} break;
+		case Kind_Sc: {
+			fprintf(out, "{ u32 a = %s + 0x%xu; u32 v = %s; ALIGNED(a); memcpy(MEM(a), &v, 4); }", rs, d->imm, rt);
+			if (d->rt) fprintf(out, " %s = 1;", rt);
+		} break;
+		case Kind_Sync: {    fprintf(out, "__atomic_thread_fence(__ATOMIC_SEQ_CST);"); } break;
+		case Kind_Beq: {
+			fprintf(out, "if (%s == %s) ", rs, rt);
+			emit_goto(out, img, d->imm);
+		} break;
+		case Kind_Bne: {
+			fprintf(out, "if (%s != %s) ", rs, rt);
+			emit_goto(out, img, d->imm);
+		} break;
+		case Kind_J: {
+			emit_goto(out, img, d->imm);
+		} break;
+		case Kind_Jal: {
+			fprintf(out, "r31 = 0x%xu; ", pc + 8);
+			emit_goto(out, img, d->imm);
+		} break;
+		case Kind_Jr: {      fprintf(out, "pc = %s; goto dispatch;", rs); } break;
+		case Kind_Syscall: { fprintf(out, "SPILL(); if (runtime_syscall(reg, mem)) return reg[4]; RELOAD();"); } break;
+		default: {
+			fprintf(out, "printf(\"Instruction %%x not handled!\\n\", 0x%xu); return 1;", d->op);
+		}
+	}
+	fprintf(out, "\n");
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <in_file> <out_file.c>\n", argv[0]);
+		return 1;
+	}
+
+	char *in_file = argv[1];
+	char *out_file = argv[2];
+
+	File bin_file;
+	if (read_file(in_file, &bin_file) == NULL) {
+		return 1;
+	}
+
+	Image img = {0};
+	if (!load_image(&bin_file, &img)) {
+		return 1;
+	}
+
+	u32 num_ops = img.size / 4;
+	if (img.entry < img.base || (img.entry - img.base) / 4 >= num_ops) {
+		printf("Entry point 0x%x is outside the image!\n", img.entry);
+		return 1;
+	}
+
+	Decoded *code = (Decoded *)calloc(num_ops + 1, sizeof(Decoded));
+	for (u32 i = 0; i < num_ops; i++) {
+		decode_op(fetch_op(img.bytes, i * 4), img.base + i * 4, &code[i]);
+	}
+
+	// Walk everything reachable from the entry point, marking block leaders
+	u8 *reach = (u8 *)calloc(num_ops + 1, 1);
+	u8 *leader = (u8 *)calloc(num_ops + 1, 1);
+	u32 *work = (u32 *)malloc((num_ops * 2 + 1) * sizeof(u32));
+	u32 num_work = 0;
+
+	work[num_work++] = img.entry;
+	while (num_work > 0) {
+		u32 target = work[--num_work];
+		u32 idx = (target - img.base) / 4;
+		if ((target & 3) || target < img.base || idx >= num_ops || !img.exec[idx]) {
+			continue;
+		}
+
+		leader[idx] = 1;
+		while (idx < num_ops && img.exec[idx] && !reach[idx]) {
+			reach[idx] = 1;
+
+			Decoded *d = &code[idx];
+			u32 pc = img.base + idx * 4;
+			if (d->kind == Kind_Beq || d->kind == Kind_Bne || d->kind == Kind_J || d->kind == Kind_Jal) {
+				work[num_work++] = d->imm;
+			}
+			if (d->kind == Kind_Jal) {
+				work[num_work++] = pc + 8;
+			}
+
+			if (d->kind == Kind_J || d->kind == Kind_Jal || d->kind == Kind_Jr || d->kind == Kind_Illegal) {
+				break;
+			}
+
+			idx++;
+			if (ends_block(d->kind)) {
+				leader[idx] = 1;
+			}
+		}
+	}
+
+	FILE *out = fopen(out_file, "w");
+	if (out == NULL) {
+		printf("Unable to open %s!\n", out_file);
+		return 1;
+	}
+
+	fprintf(out, "// Generated by recomp from %s\n", in_file);
+	fprintf(out, "#include \"runtime.h\"\n\n");
+	fprintf(out, "#define IMAGE_BASE 0x%xu\n", img.base);
+	fprintf(out, "#define IMAGE_SIZE 0x%xu\n", img.size);
+	fprintf(out, "#define MEM(addr) (mem + (u32)(addr))\n");
+	fprintf(out, "#define ALIGNED(addr) if ((addr) & 3) { printf(\"Unaligned addressing error: %%u\\n\", (addr)); return 1; }\n");
+
+	fprintf(out, "#define SPILL()");
+	for (u32 r = 1; r < 32; r++) fprintf(out, " reg[%u] = r%u;", r, r);
+	fprintf(out, "\n#define RELOAD()");
+	for (u32 r = 1; r < 32; r++) fprintf(out, " r%u = reg[%u];", r, r);
+	fprintf(out, "\n\n");
+
+	u8 *file = (u8 *)bin_file.string;
+	fprintf(out, "const u32 image_size = %u;\n", (u32)bin_file.size);
+	fprintf(out, "const u8 image[] = {");
+	for (u32 i = 0; i < bin_file.size; i++) {
+		fprintf(out, "%s0x%02x,", (i % 16) ? " " : "\n\t", file[i]);
+	}
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out, "int guest_run(u32 *reg, u8 *mem) {\n");
+	fprintf(out, "\tu32");
+	for (u32 r = 1; r < 32; r++) fprintf(out, " r%u = reg[%u]%s", r, r, r == 31 ? ";\n" : ",");
+	fprintf(out, "\tu32 hi = 0, lo = 0, pc = 0;\n");
+	fprintf(out, "\t(void)hi; (void)lo;\n\n");
+	fprintf(out, "\tgoto L_%08x;\n\n", img.entry);
+
+	for (u32 i = 0; i < num_ops; i++) {
+		if (!reach[i]) {
+			continue;
+		}
+
+		u32 pc = img.base + i * 4;
+		if (leader[i]) {
+			fprintf(out, "L_%08x:\n", pc);
+		}
+
+		emit_op(out, &img, &code[i], pc);
+
+		// Fell off the end of the executable words
+		bool falls = !(code[i].kind == Kind_J || code[i].kind == Kind_Jal ||
+			code[i].kind == Kind_Jr || code[i].kind == Kind_Illegal);
+		if (falls && (i + 1 >= num_ops || !reach[i + 1])) {
+			fprintf(out, "\treturn 0;\n");
+		}
+	}
+
+	fprintf(out, "\ndispatch:\n\tswitch (pc) {\n");
+	for (u32 i = 0; i < num_ops; i++) {
+		if (leader[i] && reach[i]) {
+			fprintf(out, "\t\tcase 0x%xu: goto L_%08x;\n", img.base + i * 4, img.base + i * 4);
+		}
+	}
+	fprintf(out, "\t\tdefault: {}\n\t}\n\n");
+	fprintf(out, "\tif (pc - IMAGE_BASE < IMAGE_SIZE) {\n");
+	fprintf(out, "\t\tprintf(\"jr to untranslated address 0x%%x\\n\", pc);\n");
+	fprintf(out, "\t\treturn 1;\n\t}\n");
+	fprintf(out, "\treturn 0;\n}\n");
+
+	fclose(out);
+	return 0;
+}
@@ -0,0 +1,61 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "common.h"
+#include "loader.h"
+#include "fault.h"
+#include "runtime.h"
+
+/*
+ * Runtime for C produced by recomp, see runtime.h. The guest gets the
+ * layout it has under emu, from the loader itself: the whole 32-bit
+ * space reserved, segments at their addresses, sp at STACK_TOP with the
+ * stack committed on use, and a heap for brk and mmap. A guest access
+ * to anything unmapped ends the program with status 1, as under emu.
+ */
+
+static Sys *guest_sys;
+
+bool runtime_syscall(u32 *reg, u8 *mem) {
+	u32 action = syscall_exec(guest_sys, reg, mem);
+	if (action == Sys_Exit) {
+		return true;
+	}
+
+	// There is only the one thread, so no harts
+	if (action == Sys_Spawn) {
+		reg[2] = -1;
+	}
+	sys_wait(action, reg, mem);
+	return false;
+}
+
+int main(void) {
+	Machine m = {0};
+	if (!load_program_buffer(&m, (void *)image, image_size)) {
+		return 1;
+	}
+	guest_sys = m.sys;
+	fault_init();
+
+	sigjmp_buf env;
+	if (sigsetjmp(env, 1)) {
+		fault_env = NULL;
+		sys_flush(guest_sys);
+		printf("Segmentation fault at 0x%x\n", fault_addr);
+		return 1;
+	}
+
+	fault_machine = &m;
+	fault_env = &env;
+	int status = guest_run(m.reg, m.mem);
+	fault_env = NULL;
+
+	sys_flush(guest_sys);
+	return status;
+}
@@ -0,0 +1,27 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+/*
+ * What C produced by recomp builds against. The generated file defines
+ * the guest binary and guest_run(); src/runtime.c, linked in with it,
+ * lays out guest memory, runs syscalls and has main.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "common.h"
+
+// The binary as recomp read it, laid out by the runtime as emu would
+extern const u8 image[];
+extern const u32 image_size;
+
+// Runs the guest from its entry; mem is the base of the 32-bit guest space
+int guest_run(u32 *reg, u8 *mem);
+
+// Runs the syscall the guest is at; true if it was exit, with the status in a0
+bool runtime_syscall(u32 *reg, u8 *mem);
+
+#endif
@@ -0,0 +1,602 @@
+/*
+ * emu --serve: a daemon that runs jobs for clients over a Unix domain
+ * socket. Included by emu.c after batch.h.
+ *
+ * A job names a binary, by path or by carrying its bytes, with what the
+ * guest reads on stdin and an instruction budget. The reply has how the
+ * guest ended, what it wrote to stdout and stderr, and some stats.
+ *
+ * Machines stay warm between jobs. The first job for a binary loads it,
+ * predecodes its text and snapshots the guest at its entry; once the job
+ * is done the machine is restored from that snapshot and kept on the
+ * binary's idle list, and the next job for the binary starts from there
+ * with its blocks (and with --jit, their native code) already built.
+ * Jobs running a binary at the same time each get a machine of their own,
+ * all sharing one predecoded text as in --batch. Binaries are known by
+ * path, and read again when the file changes, or by their bytes.
+ *
+ * Clients can send any number of requests without waiting for replies:
+ * a thread per connection reads them onto one queue that --threads
+ * workers take jobs from, so replies come back in whatever order the jobs
+ * finish, tagged with the request's id. Everything is in host byte order:
+ *
+ *   request: ServeRequest, image_len bytes of path or binary, input_len bytes of stdin
+ *   reply:   ServeReply, out_len bytes of output
+ *
+ * A request that can't be framed (too large, or a path that long) closes
+ * the connection once the jobs before it have replied.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+
+#define SERVE_MAX_BINARIES 256
+// Machines kept idle across all binaries, past which finished ones are freed
+#define SERVE_MAX_IDLE 256
+#define SERVE_MAX_QUEUED 4096
+// Stack committed before the snapshot, as for --fuzz, so jobs don't each fault it in
+#define SERVE_STACK (64 * 1024)
+#define SERVE_MAX_IMAGE (256 << 20)
+#define SERVE_MAX_INPUT (256 << 20)
+
+// Request flags: the image is the binary itself rather than its path
+#define SERVE_IMAGE 1
+
+typedef struct ServeRequest {
+	u32 id;
+	u32 flags;
+	u32 image_len;
+	u32 input_len;
+	// 0 for no limit
+	u64 budget;
+} ServeRequest;
+
+enum {
+	// status is the exit status, as the process's would be
+	Serve_Exit,
+	// status is the address the guest faulted at (for an unknown
+	// instruction, its pc)
+	Serve_Fault,
+	// Ran out of budget
+	Serve_Budget,
+	// The binary couldn't be loaded
+	Serve_Error,
+};
+
+typedef struct ServeReply {
+	u32 id;
+	u32 stop;
+	i32 status;
+	u32 out_len;
+	u64 instructions;
+	// The run itself, and the whole job including any loading
+	u32 run_us;
+	u32 job_us;
+	// 1 if the job ran on a machine an earlier job left warm
+	u32 warm;
+	u32 pad;
+} ServeReply;
+
+typedef struct ServeConn {
+	int fd;
+	pthread_mutex_t write_lock;
+	// The reader, while it runs, and every job not yet replied to
+	u32 refs;
+	struct Serve *serve;
+} ServeConn;
+
+typedef struct ServeJob {
+	ServeConn *conn;
+	ServeRequest req;
+	// The image, NUL terminated, then the input
+	u8 *data;
+	struct ServeJob *next;
+} ServeJob;
+
+typedef struct ServeMachine {
+	Machine m;
+	Snapshot *snap;
+	struct ServeMachine *next;
+} ServeMachine;
+
+typedef struct ServeBinary {
+	// NULL for a binary sent as bytes
+	char *path;
+	struct stat st;
+	u8 *image;
+	u64 image_size;
+	u64 hash;
+
+	pthread_mutex_t lock;
+	Decoded *code;
+	u32 code_records;
+	// code is mapped from the --cache directory rather than allocated
+	bool code_cached;
+	ServeMachine *idle;
+
+	// The table's, while the binary is in it, and every job running it
+	u32 refs;
+	u64 used;
+} ServeBinary;
+
+typedef struct Serve {
+	pthread_mutex_t queue_lock;
+	pthread_cond_t ready;
+	pthread_cond_t room;
+	ServeJob *head;
+	ServeJob *tail;
+	u32 queued;
+
+	pthread_mutex_t lock;
+	ServeBinary *binaries[SERVE_MAX_BINARIES];
+	u32 num_binaries;
+	u64 clock;
+	u32 num_idle;
+
+	int (*run)(Machine *);
+	bool use_jit;
+	char *cache_dir;
+} Serve;
+
+static bool serve_read_all(int fd, void *buf, u64 len) {
+	u64 done = 0;
+	while (done < len) {
+		ssize_t n = read(fd, (u8 *)buf + done, len - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+static bool serve_write_all(int fd, void *buf, u64 len) {
+	u64 done = 0;
+	while (done < len) {
+		ssize_t n = send(fd, (u8 *)buf + done, len - done, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+void serve_conn_put(ServeConn *c) {
+	if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		close(c->fd);
+		pthread_mutex_destroy(&c->write_lock);
+		free(c);
+	}
+}
+
+void serve_machine_free(ServeMachine *sm) {
+	if (sm->snap != NULL) {
+		snapshot_free(sm->snap);
+	}
+	batch_free_job(&sm->m);
+	free(sm);
+}
+
+void serve_binary_put(Serve *sv, ServeBinary *b) {
+	if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+
+	while (b->idle != NULL) {
+		ServeMachine *sm = b->idle;
+		b->idle = sm->next;
+		serve_machine_free(sm);
+		__atomic_sub_fetch(&sv->num_idle, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_destroy(&b->lock);
+	if (b->code_cached) {
+		tcache_unmap(b->code, b->code_records);
+	} else {
+		free(b->code);
+	}
+	free(b->image);
+	free(b->path);
+	free(b);
+}
+
+static bool serve_binary_match(ServeBinary *b, ServeBinary *key) {
+	if (key->path != NULL) {
+		return b->path != NULL && strcmp(b->path, key->path) == 0;
+	}
+	return b->path == NULL && b->image_size == key->image_size && b->hash == key->hash &&
+		memcmp(b->image, key->image, key->image_size) == 0;
+}
+
+// Takes a reference to the table's binary for key, dropping it instead if its file has changed
+static ServeBinary *serve_binary_find(Serve *sv, ServeBinary *key) {
+	for (u32 i = 0; i < sv->num_binaries; i++) {
+		ServeBinary *b = sv->binaries[i];
+		if (!serve_binary_match(b, key)) {
+			continue;
+		}
+
+		if (key->path != NULL && (b->st.st_dev != key->st.st_dev || b->st.st_ino != key->st.st_ino ||
+			b->st.st_size != key->st.st_size || b->st.st_mtim.tv_sec != key->st.st_mtim.tv_sec ||
+			b->st.st_mtim.tv_nsec != key->st.st_mtim.tv_nsec)) {
+			sv->binaries[i] = sv->binaries[--sv->num_binaries];
+			serve_binary_put(sv, b);
+			return NULL;
+		}
+
+		b->used = ++sv->clock;
+		__atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+		return b;
+	}
+	return NULL;
+}
+
+// Adds b to the table, making room by dropping the binary used longest ago
+static void serve_binary_insert(Serve *sv, ServeBinary *b) {
+	if (sv->num_binaries == SERVE_MAX_BINARIES) {
+		u32 lru = 0;
+		for (u32 i = 1; i < sv->num_binaries; i++) {
+			if (sv->binaries[i]->used < sv->binaries[lru]->used) {
+				lru = i;
+			}
+		}
+		ServeBinary *old = sv->binaries[lru];
+		sv->binaries[lru] = sv->binaries[--sv->num_binaries];
+		serve_binary_put(sv, old);
+	}
+
+	b->used = ++sv->clock;
+	sv->binaries[sv->num_binaries++] = b;
+}
+
+static u8 *serve_read_file(char *path, u64 size) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	u8 *image = (u8 *)malloc(size ? size : 1);
+	bool ok = serve_read_all(fd, image, size);
+	close(fd);
+	if (!ok) {
+		free(image);
+		return NULL;
+	}
+	return image;
+}
+
+// The binary a job runs, with a reference the caller puts back; NULL if it can't be loaded
+ServeBinary *serve_binary_get(Serve *sv, ServeJob *job) {
+	ServeBinary key = {0};
+	if (job->req.flags & SERVE_IMAGE) {
+		key.image = job->data;
+		key.image_size = job->req.image_len;
+		key.hash = hash_bytes(key.image, key.image_size);
+	} else {
+		key.path = (char *)job->data;
+		if (stat(key.path, &key.st) != 0 || !S_ISREG(key.st.st_mode)) {
+			printf("%s not found!\n", key.path);
+			return NULL;
+		}
+	}
+
+	pthread_mutex_lock(&sv->lock);
+	ServeBinary *b = serve_binary_find(sv, &key);
+	pthread_mutex_unlock(&sv->lock);
+	if (b != NULL) {
+		return b;
+	}
+
+	// Reading the file and hashing happen outside the lock, so another
+	// job may add the same binary first
+	ServeBinary *fresh = (ServeBinary *)calloc(1, sizeof(ServeBinary));
+	pthread_mutex_init(&fresh->lock, NULL);
+	fresh->refs = 2;
+	fresh->hash = key.hash;
+	if (key.path != NULL) {
+		fresh->path = strdup(key.path);
+		fresh->st = key.st;
+		fresh->image_size = key.st.st_size;
+		fresh->image = serve_read_file(key.path, fresh->image_size);
+		if (fresh->image == NULL) {
+			printf("%s: unable to read!\n", key.path);
+			fresh->refs = 1;
+			serve_binary_put(sv, fresh);
+			return NULL;
+		}
+	} else {
+		fresh->image_size = key.image_size;
+		fresh->image = (u8 *)malloc(key.image_size);
+		memcpy(fresh->image, key.image, key.image_size);
+	}
+
+	pthread_mutex_lock(&sv->lock);
+	b = serve_binary_find(sv, &key);
+	if (b == NULL) {
+		serve_binary_insert(sv, fresh);
+	}
+	pthread_mutex_unlock(&sv->lock);
+
+	if (b != NULL) {
+		fresh->refs = 1;
+		serve_binary_put(sv, fresh);
+		return b;
+	}
+	return fresh;
+}
+
+// A machine for b at its entry: one left idle by an earlier job, or a new one
+ServeMachine *serve_machine_get(Serve *sv, ServeBinary *b, bool *warm) {
+	pthread_mutex_lock(&b->lock);
+	ServeMachine *sm = b->idle;
+	if (sm != NULL) {
+		b->idle = sm->next;
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	*warm = sm != NULL;
+	if (sm != NULL) {
+		__atomic_sub_fetch(&sv->num_idle, 1, __ATOMIC_RELAXED);
+		return sm;
+	}
+
+	sm = (ServeMachine *)calloc(1, sizeof(ServeMachine));
+	Machine *m = &sm->m;
+	if (!load_program_buffer(m, b->image, b->image_size)) {
+		free(sm);
+		return NULL;
+	}
+	m->quiet = true;
+	m->sys->capture = true;
+
+	// The first machine decodes the text for the rest
+	pthread_mutex_lock(&b->lock);
+	if (b->code == NULL) {
+		b->code_cached = predecode(m, sv->cache_dir);
+		b->code = m->code;
+		b->code_records = m->code_size + 1;
+	} else {
+		m->code = b->code;
+		blocks_init(m);
+	}
+	m->code_shared = true;
+	pthread_mutex_unlock(&b->lock);
+
+	if (sv->use_jit) {
+		m->jit = jit_init();
+	}
+
+	if (mprotect(m->mem + STACK_TOP - SERVE_STACK, SERVE_STACK, PROT_READ | PROT_WRITE) == 0) {
+		m->stack_low = STACK_TOP - SERVE_STACK;
+	}
+
+	sm->snap = snapshot_take(m);
+	if (sm->snap == NULL) {
+		serve_machine_free(sm);
+		return NULL;
+	}
+	return sm;
+}
+
+// Puts a machine back at its entry and on b's idle list
+void serve_machine_put(Serve *sv, ServeBinary *b, ServeMachine *sm) {
+	Machine *m = &sm->m;
+	sys_reset(m->sys);
+	bool keep = snapshot_restore_touched(m, sm->snap);
+	if (keep && __atomic_add_fetch(&sv->num_idle, 1, __ATOMIC_RELAXED) > SERVE_MAX_IDLE) {
+		__atomic_sub_fetch(&sv->num_idle, 1, __ATOMIC_RELAXED);
+		keep = false;
+	}
+	if (!keep) {
+		serve_machine_free(sm);
+		return;
+	}
+
+	pthread_mutex_lock(&b->lock);
+	sm->next = b->idle;
+	b->idle = sm;
+	pthread_mutex_unlock(&b->lock);
+}
+
+void serve_reply(ServeConn *c, ServeReply *reply, u8 *out) {
+	pthread_mutex_lock(&c->write_lock);
+	if (serve_write_all(c->fd, reply, sizeof(ServeReply))) {
+		serve_write_all(c->fd, out, reply->out_len);
+	}
+	pthread_mutex_unlock(&c->write_lock);
+}
+
+void serve_run_job(Serve *sv, ServeJob *job) {
+	double start = now_us();
+
+	ServeReply reply = {0};
+	reply.id = job->req.id;
+	reply.stop = Serve_Error;
+
+	bool warm = false;
+	ServeBinary *b = serve_binary_get(sv, job);
+	ServeMachine *sm = b != NULL ? serve_machine_get(sv, b, &warm) : NULL;
+
+	u8 *out = NULL;
+	if (sm != NULL) {
+		Machine *m = &sm->m;
+		Sys *s = m->sys;
+		s->input = job->data + job->req.image_len + 1;
+		s->input_len = job->req.input_len;
+		s->input_pos = 0;
+
+		u64 budget = job->req.budget;
+		double run_start = now_us();
+		int status;
+		reply.instructions = run_budget(sv->run, m, budget == 0 || budget > BUDGET_UNLIMITED ? BUDGET_UNLIMITED : (i64)budget, &status);
+		reply.run_us = now_us() - run_start;
+
+		switch (m->stop) {
+			case Stop_Budget: {
+				reply.stop = Serve_Budget;
+			} break;
+			case Stop_Fault: {
+				reply.stop = Serve_Fault;
+				reply.status = fault_addr;
+			} break;
+			default: {
+				reply.stop = Serve_Exit;
+				reply.status = status & 0xFF;
+			}
+		}
+		reply.warm = warm;
+		reply.out_len = s->output_len;
+		out = s->output;
+	}
+
+	reply.job_us = now_us() - start;
+	serve_reply(job->conn, &reply, out);
+
+	// The machine is restored after the reply, off the client's wait
+	if (sm != NULL) {
+		serve_machine_put(sv, b, sm);
+	}
+	if (b != NULL) {
+		serve_binary_put(sv, b);
+	}
+
+	serve_conn_put(job->conn);
+	free(job->data);
+	free(job);
+}
+
+void *serve_worker(void *arg) {
+	Serve *sv = (Serve *)arg;
+
+	while (true) {
+		pthread_mutex_lock(&sv->queue_lock);
+		while (sv->head == NULL) {
+			pthread_cond_wait(&sv->ready, &sv->queue_lock);
+		}
+		ServeJob *job = sv->head;
+		sv->head = job->next;
+		if (sv->head == NULL) {
+			sv->tail = NULL;
+		}
+		sv->queued--;
+		pthread_cond_signal(&sv->room);
+		pthread_mutex_unlock(&sv->queue_lock);
+
+		serve_run_job(sv, job);
+	}
+
+	return NULL;
+}
+
+void serve_push(Serve *sv, ServeJob *job) {
+	pthread_mutex_lock(&sv->queue_lock);
+	while (sv->queued == SERVE_MAX_QUEUED) {
+		pthread_cond_wait(&sv->room, &sv->queue_lock);
+	}
+	if (sv->tail != NULL) {
+		sv->tail->next = job;
+	} else {
+		sv->head = job;
+	}
+	sv->tail = job;
+	sv->queued++;
+	pthread_cond_signal(&sv->ready);
+	pthread_mutex_unlock(&sv->queue_lock);
+}
+
+void *serve_reader(void *arg) {
+	ServeConn *c = (ServeConn *)arg;
+
+	while (true) {
+		ServeRequest req;
+		if (!serve_read_all(c->fd, &req, sizeof(req))) {
+			break;
+		}
+
+		if (req.image_len == 0 || req.image_len > SERVE_MAX_IMAGE || req.input_len > SERVE_MAX_INPUT ||
+			(!(req.flags & SERVE_IMAGE) && req.image_len >= PATH_MAX)) {
+			printf("Bad request %u, closing the connection\n", req.id);
+			break;
+		}
+
+		ServeJob *job = (ServeJob *)calloc(1, sizeof(ServeJob));
+		job->conn = c;
+		job->req = req;
+		job->data = (u8 *)malloc((u64)req.image_len + 1 + req.input_len);
+		job->data[req.image_len] = 0;
+		if (!serve_read_all(c->fd, job->data, req.image_len) ||
+			!serve_read_all(c->fd, job->data + req.image_len + 1, req.input_len)) {
+			free(job->data);
+			free(job);
+			break;
+		}
+
+		__atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+		serve_push(c->serve, job);
+	}
+
+	serve_conn_put(c);
+	return NULL;
+}
+
+int run_serve(Serve *sv, char *path, u32 num_workers) {
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printf("%s: socket path too long!\n", path);
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	unlink(path);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+		printf("Unable to listen on %s!\n", path);
+		return 1;
+	}
+
+	pthread_mutex_init(&sv->queue_lock, NULL);
+	pthread_cond_init(&sv->ready, NULL);
+	pthread_cond_init(&sv->room, NULL);
+	pthread_mutex_init(&sv->lock, NULL);
+
+	for (u32 i = 0; i < num_workers; i++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, serve_worker, sv);
+		pthread_detach(thread);
+	}
+
+	printf("Serving on %s with %u threads\n", path, num_workers);
+	fflush(stdout);
+
+	while (true) {
+		int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			printf("Unable to accept on %s!\n", path);
+			return 1;
+		}
+
+		ServeConn *c = (ServeConn *)calloc(1, sizeof(ServeConn));
+		c->fd = client;
+		c->refs = 1;
+		c->serve = sv;
+		pthread_mutex_init(&c->write_lock, NULL);
+
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, serve_reader, c) != 0) {
+			serve_conn_put(c);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
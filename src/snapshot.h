@@ -0,0 +1,278 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "loader.h"
+#include "machine.h"
+
+/*
+ * Copy-on-write snapshots of a running guest. Taking one copies the
+ * mapped guest pages into a memfd once and maps them back over guest
+ * memory MAP_PRIVATE, so from then on the guest only ever writes to its
+ * own private copies. Restoring maps the memfd over the same ranges
+ * again, which drops those copies in one mmap per region: the cost is
+ * the number of pages the guest touched, not the size of its memory.
+ * The committed stack and the heap's brk and mmap areas are saved as
+ * regions too, along with the heap's bookkeeping.
+ *
+ * The memfd is also mapped read-only on its own, so snapshot_restore_pages
+ * can copy back just the pages a caller knows were written, and
+ * snapshot_restore_touched just the ones the host's page tables say the
+ * guest has its own copies of.
+ */
+
+// Pages snapshot_restore_touched copies back before it remaps instead
+#define SNAPSHOT_TOUCHED_MAX 256
+// Restores by snapshot_restore_touched between two that remap everything
+#define SNAPSHOT_REMAP_EVERY 64
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_SWAPPED (1ULL << 62)
+#define PAGEMAP_FILE (1ULL << 61)
+
+typedef struct Snapshot {
+	u32 reg[32];
+	u32 hi;
+	u32 lo;
+	u32 pc;
+
+	int fd;
+	// The machine's, then the stack and the two heap areas
+	Region regions[MAX_REGIONS + 3];
+	u64 offs[MAX_REGIONS + 3];
+	u32 num_regions;
+	u32 stack_low;
+	Heap *heap;
+	u8 *pristine;
+	u64 size;
+	u32 code_writes;
+	// snapshot_restore_touched calls since the last full remap
+	u32 touched_restores;
+} Snapshot;
+
+static bool snapshot_map(Machine *m, Snapshot *s) {
+	for (u32 i = 0; i < s->num_regions; i++) {
+		Region *r = &s->regions[i];
+		if (mmap(m->mem + r->start, r->size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_FIXED, s->fd, s->offs[i]) == MAP_FAILED) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void snapshot_add(Snapshot *s, u32 start, u32 end) {
+	if (end > start) {
+		s->regions[s->num_regions].start = start;
+		s->regions[s->num_regions].size = end - start;
+		s->num_regions++;
+	}
+}
+
+Snapshot *snapshot_take(Machine *m) {
+	Snapshot *s = (Snapshot *)calloc(1, sizeof(Snapshot));
+	memcpy(s->reg, m->reg, sizeof(s->reg));
+	s->hi = m->hi;
+	s->lo = m->lo;
+	s->pc = m->pc;
+	s->code_writes = m->code_writes;
+	s->stack_low = m->stack_low;
+
+	s->num_regions = m->num_regions;
+	memcpy(s->regions, m->regions, m->num_regions * sizeof(Region));
+
+	// The committed part of the stack is saved like any other region
+	if (m->stack_low < STACK_TOP) {
+		mprotect(m->mem + m->stack_low, STACK_TOP - m->stack_low, PROT_READ | PROT_WRITE);
+		snapshot_add(s, m->stack_low, STACK_TOP);
+	}
+
+	s->heap = heap_copy(m->sys->heap);
+	snapshot_add(s, s->heap->brk_base, s->heap->brk_end);
+	snapshot_add(s, s->heap->mmap_low, HEAP_MMAP_TOP);
+
+	s->fd = memfd_create("guest", MFD_CLOEXEC);
+	if (s->fd < 0) {
+		heap_free(s->heap);
+		free(s);
+		return NULL;
+	}
+
+	u64 total = 0;
+	for (u32 i = 0; i < s->num_regions; i++) {
+		Region *r = &s->regions[i];
+		s->offs[i] = total;
+		if (pwrite(s->fd, m->mem + r->start, r->size, total) != r->size) {
+			close(s->fd);
+			heap_free(s->heap);
+			free(s);
+			return NULL;
+		}
+		total += r->size;
+	}
+
+	s->size = total;
+	s->pristine = (u8 *)mmap(NULL, total ? total : 1, PROT_READ, MAP_SHARED, s->fd, 0);
+	if (s->pristine == MAP_FAILED) {
+		close(s->fd);
+		heap_free(s->heap);
+		free(s);
+		return NULL;
+	}
+
+	if (!snapshot_map(m, s)) {
+		munmap(s->pristine, s->size ? s->size : 1);
+		close(s->fd);
+		heap_free(s->heap);
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+static void snapshot_restore_regs(Machine *m, Snapshot *s) {
+	memcpy(m->reg, s->reg, sizeof(s->reg));
+	m->hi = s->hi;
+	m->lo = s->lo;
+	m->pc = s->pc;
+
+	// Stack the guest grew into since goes back to faulting
+	if (m->stack_low < s->stack_low) {
+		mmap(m->mem + m->stack_low, s->stack_low - m->stack_low, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+		m->stack_low = s->stack_low;
+	}
+}
+
+static void snapshot_restore_code(Machine *m, Snapshot *s) {
+	if (m->code_writes != s->code_writes) {
+		code_reset(m);
+		m->code_writes = s->code_writes;
+	}
+}
+
+bool snapshot_restore(Machine *m, Snapshot *s) {
+	s->touched_restores = 0;
+	snapshot_restore_regs(m, s);
+	heap_restore(m->sys->heap, s->heap);
+
+	if (!snapshot_map(m, s)) {
+		return false;
+	}
+
+	snapshot_restore_code(m, s);
+	return true;
+}
+
+/*
+ * Like snapshot_restore, but copies back only the listed pages, which
+ * have to include every page written since the snapshot was taken or
+ * last restored. The heap mustn't have moved since either. Pages the
+ * snapshot doesn't have (new stack) are left to snapshot_restore_regs.
+ */
+bool snapshot_restore_pages(Machine *m, Snapshot *s, u32 *pages, u32 num_pages) {
+	snapshot_restore_regs(m, s);
+
+	u32 page = getpagesize();
+	for (u32 i = 0; i < num_pages; i++) {
+		u32 addr = pages[i];
+		for (u32 j = 0; j < s->num_regions; j++) {
+			Region *r = &s->regions[j];
+			if (addr - r->start < r->size) {
+				memcpy(m->mem + addr, s->pristine + s->offs[j] + (addr - r->start), page);
+				break;
+			}
+		}
+	}
+
+	snapshot_restore_code(m, s);
+	return true;
+}
+
+// /proc/self/pagemap, opened the first time it's needed
+static int snapshot_pagemap = -1;
+
+static int snapshot_pagemap_fd() {
+	int fd = __atomic_load_n(&snapshot_pagemap, __ATOMIC_ACQUIRE);
+	if (fd >= 0) {
+		return fd;
+	}
+
+	fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	int none = -1;
+	if (fd >= 0 && !__atomic_compare_exchange_n(&snapshot_pagemap, &none, fd, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		close(fd);
+		fd = none;
+	}
+	return fd;
+}
+
+/*
+ * Like snapshot_restore, but finds the pages that are no longer the
+ * memfd's in the host's pagemap and copies just those back. They stay
+ * the guest's own afterwards, so a guest run over and over from one
+ * snapshot stops taking a fault per page it writes. The pagemap can't
+ * tell those apart from pages written since, though: what's copied is
+ * every page written since the last full remap, not just since the last
+ * restore. To keep a page some early job wrote from being copied for the
+ * rest of the machine's life, this remaps everything as snapshot_restore
+ * does every SNAPSHOT_REMAP_EVERY restores, and whenever more than
+ * SNAPSHOT_TOUCHED_MAX pages need copying. So does a heap that has
+ * handed out mmap pages since, as those can have been remapped.
+ */
+bool snapshot_restore_touched(Machine *m, Snapshot *s) {
+	Heap *h = m->sys->heap;
+	int pagemap = snapshot_pagemap_fd();
+	if (++s->touched_restores > SNAPSHOT_REMAP_EVERY || pagemap < 0 ||
+		h->mmap_low != s->heap->mmap_low || h->mmap_next != s->heap->mmap_next ||
+		h->num_free != s->heap->num_free || memcmp(h->free, s->heap->free, h->num_free * sizeof(Region)) != 0) {
+		return snapshot_restore(m, s);
+	}
+
+	snapshot_restore_regs(m, s);
+	heap_restore(h, s->heap);
+
+	u32 page = getpagesize();
+	u32 touched = 0;
+	u64 entries[512];
+	for (u32 i = 0; i < s->num_regions; i++) {
+		Region *r = &s->regions[i];
+		for (u32 done = 0; done < r->size / page; ) {
+			u32 n = r->size / page - done;
+			n = n < 512 ? n : 512;
+			u64 first = ((uintptr_t)(m->mem + r->start) / page + done) * sizeof(u64);
+			if (pread(pagemap, entries, n * sizeof(u64), first) != (ssize_t)(n * sizeof(u64))) {
+				return snapshot_restore(m, s);
+			}
+
+			for (u32 j = 0; j < n; j++) {
+				// Present and not the memfd's, or swapped out, which only the guest's own pages can be
+				if ((entries[j] & (PAGEMAP_PRESENT | PAGEMAP_FILE)) != PAGEMAP_PRESENT && !(entries[j] & PAGEMAP_SWAPPED)) {
+					continue;
+				}
+				if (++touched > SNAPSHOT_TOUCHED_MAX) {
+					return snapshot_restore(m, s);
+				}
+				u64 off = (u64)(done + j) * page;
+				memcpy(m->mem + r->start + off, s->pristine + s->offs[i] + off, page);
+			}
+			done += n;
+		}
+	}
+
+	snapshot_restore_code(m, s);
+	return true;
+}
+
+void snapshot_free(Snapshot *s) {
+	munmap(s->pristine, s->size ? s->size : 1);
+	close(s->fd);
+	heap_free(s->heap);
+	free(s);
+}
+
+#endif
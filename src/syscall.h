@@ -0,0 +1,626 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "heap.h"
+
+/*
+ * Guest syscalls, numbered as in the o32 Linux ABI: v0 holds 4000 + n
+ * (0x4000 + n, which emu has always taken, works too) and the arguments
+ * are in a0-a3. The result comes back in v0 with a3 = 0, or the errno
+ * in v0 with a3 = 1 on failure.
+ *
+ * Guest fds index a table of host fds, where 0-2 start out as the host's
+ * own. Writes to an fd collect in a buffer of SYS_BUF_SIZE bytes, so a
+ * guest printing a line at a time costs a host write per buffer rather
+ * than per line. A buffer is flushed when it fills, on fsync, lseek or
+ * close of its fd, before a read of anything but a regular file (so
+ * prompts come out before the guest waits on input) and when the guest
+ * exits. fd 2 isn't buffered.
+ *
+ * Guest buffers are touched before the lock is taken, so a bad one
+ * faults the guest like a load or store would, and a stack page gets
+ * committed before the kernel sees it.
+ *
+ * An async Sys (see timeslice.h) doesn't wait on the host for reads, or
+ * for writes that have to go out: syscall_exec describes the host call
+ * in io and returns Sys_Io, and whoever runs the guest makes the call
+ * and hands its result to sys_io_done. The flushes fsync, lseek, close
+ * and reads do first still happen in place.
+ *
+ * A Sys given an input serves reads of fd 0 from it rather than the
+ * host's stdin (see fuzz.h). One that captures keeps what the guest
+ * writes to the host's stdout and stderr, up to SYS_MAX_OUTPUT bytes,
+ * instead of writing it out (see serve.h).
+ *
+ * sys_reset puts the fd table back as it was at the last sys_keep (or
+ * as sys_init left it), for running the guest again from a snapshot:
+ * files opened since are closed, and files open then are open again at
+ * the offset they had.
+ *
+ * brk, mmap and munmap go to the guest's Heap (see heap.h); a Sys
+ * without one has no memory to give out.
+ */
+
+#define SYS_MAX_FILES 64
+#define SYS_BUF_SIZE (64 * 1024)
+#define SYS_MAX_OUTPUT (16 << 20)
+// Returned by the sys_ helpers when an async Sys has set up io instead
+#define SYS_PENDING INT32_MIN
+
+enum {
+	SysIo_Read,
+	SysIo_Write,
+	// Writes out a file's buffer, then goes on buffering the guest's write
+	SysIo_Flush,
+};
+
+typedef struct SysIo {
+	u8 op;
+	int host;
+	u8 *buf;
+	u32 len;
+
+	// For SysIo_Flush, the guest write to carry on with
+	u32 fd;
+	u8 *src;
+	u32 src_len;
+	u32 done;
+} SysIo;
+
+typedef struct SysFile {
+	// -1 if the guest fd isn't open
+	int host;
+	// Opened by the guest, so closing it closes the host fd too
+	bool owned;
+	bool buffered;
+	bool regular;
+	u8 *buf;
+	u32 len;
+} SysFile;
+
+// Shared by all the harts of a guest
+typedef struct Sys {
+	pthread_mutex_t lock;
+	SysFile files[SYS_MAX_FILES];
+	// The fd table at sys_keep(), with a dup of each file the guest owned
+	SysFile kept[SYS_MAX_FILES];
+	off_t kept_pos[SYS_MAX_FILES];
+
+	bool async;
+	SysIo io;
+
+	Heap *heap;
+
+	u8 *input;
+	u32 input_len;
+	u32 input_pos;
+
+	bool capture;
+	u8 *output;
+	u32 output_len;
+	u32 output_cap;
+} Sys;
+
+void print_reg(u32 *reg) {
+	for (u32 i = 0; i < 32; i++) {
+		printf("r%u: 0x%x\n", i, reg[i]);
+	}
+}
+
+enum {
+	Sys_Continue,
+	Sys_Exit,
+	Sys_Yield,
+	Sys_Sleep,
+	Sys_Spawn,
+	Sys_Io,
+};
+
+static bool sys_regular(int host) {
+	struct stat st;
+	return fstat(host, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+Sys *sys_init() {
+	Sys *s = (Sys *)calloc(1, sizeof(Sys));
+	pthread_mutex_init(&s->lock, NULL);
+	for (u32 i = 0; i < SYS_MAX_FILES; i++) {
+		s->files[i].host = i < 3 ? (int)i : -1;
+		s->files[i].buffered = i != 2;
+		s->files[i].regular = i < 3 && sys_regular(i);
+		s->kept[i] = s->files[i];
+	}
+	return s;
+}
+
+// Writes out what f has buffered; returns 0 or the errno the host write failed with
+static int sys_flush_file(SysFile *f) {
+	u32 done = 0;
+	int err = 0;
+	while (done < f->len) {
+		ssize_t n = write(f->host, f->buf + done, f->len - done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err = errno;
+			break;
+		}
+		done += n;
+	}
+
+	f->len = 0;
+	return err;
+}
+
+static void sys_flush_locked(Sys *s) {
+	for (u32 i = 0; i < SYS_MAX_FILES; i++) {
+		if (s->files[i].len > 0) {
+			sys_flush_file(&s->files[i]);
+		}
+	}
+}
+
+void sys_flush(Sys *s) {
+	pthread_mutex_lock(&s->lock);
+	sys_flush_locked(s);
+	pthread_mutex_unlock(&s->lock);
+}
+
+void sys_free(Sys *s) {
+	sys_flush(s);
+	for (u32 i = 0; i < SYS_MAX_FILES; i++) {
+		if (s->files[i].owned) {
+			close(s->files[i].host);
+		}
+		if (s->kept[i].owned) {
+			close(s->kept[i].host);
+		}
+		free(s->files[i].buf);
+	}
+	free(s->output);
+	if (s->heap != NULL) {
+		heap_free(s->heap);
+	}
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+// Saves the fd table for sys_reset() to go back to
+void sys_keep(Sys *s) {
+	pthread_mutex_lock(&s->lock);
+	sys_flush_locked(s);
+	for (u32 i = 0; i < SYS_MAX_FILES; i++) {
+		SysFile *f = &s->files[i];
+		SysFile *k = &s->kept[i];
+		if (k->owned) {
+			close(k->host);
+		}
+
+		*k = *f;
+		k->buf = NULL;
+		k->len = 0;
+		if (f->owned) {
+			k->host = dup(f->host);
+			s->kept_pos[i] = lseek(f->host, 0, SEEK_CUR);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+// Closes what the guest opened since sys_keep() and opens again what it had then
+void sys_reset(Sys *s) {
+	pthread_mutex_lock(&s->lock);
+	sys_flush_locked(s);
+	for (u32 i = 0; i < SYS_MAX_FILES; i++) {
+		SysFile *f = &s->files[i];
+		SysFile *k = &s->kept[i];
+		if (f->owned) {
+			close(f->host);
+		}
+
+		f->host = k->host;
+		f->owned = k->owned;
+		f->buffered = k->buffered;
+		f->regular = k->regular;
+		if (k->owned) {
+			f->host = dup(k->host);
+			lseek(f->host, s->kept_pos[i], SEEK_SET);
+		}
+	}
+
+	s->input = NULL;
+	s->input_len = 0;
+	s->input_pos = 0;
+	s->output_len = 0;
+	pthread_mutex_unlock(&s->lock);
+}
+
+static SysFile *sys_file(Sys *s, u32 fd) {
+	if (fd >= SYS_MAX_FILES || s->files[fd].host < 0) {
+		return NULL;
+	}
+	return &s->files[fd];
+}
+
+// Faults in every page of the guest range [addr, addr + len), or returns false if it wraps
+static bool sys_touch(u8 *mem, u32 addr, u32 len) {
+	if ((u64)addr + len > 1ULL << 32) {
+		return false;
+	}
+
+	u32 page = getpagesize();
+	for (u64 a = addr & ~(page - 1); a < (u64)addr + len; a += page) {
+		(void)*(volatile u8 *)(mem + a);
+	}
+	return true;
+}
+
+static i32 sys_pend(Sys *s, u8 op, int host, u8 *buf, u32 len) {
+	s->io.op = op;
+	s->io.host = host;
+	s->io.buf = buf;
+	s->io.len = len;
+	return SYS_PENDING;
+}
+
+// Buffers what's left of a guest write from done on, flushing each time the buffer fills
+static i32 sys_write_from(Sys *s, u32 fd, u8 *src, u32 len, u32 done) {
+	SysFile *f = &s->files[fd];
+	if (f->buf == NULL) {
+		f->buf = (u8 *)malloc(SYS_BUF_SIZE);
+	}
+
+	while (done < len) {
+		u32 n = len - done;
+		if (n > SYS_BUF_SIZE - f->len) {
+			n = SYS_BUF_SIZE - f->len;
+		}
+		memcpy(f->buf + f->len, src + done, n);
+		f->len += n;
+		done += n;
+
+		if (f->len == SYS_BUF_SIZE) {
+			if (s->async) {
+				s->io.fd = fd;
+				s->io.src = src;
+				s->io.src_len = len;
+				s->io.done = done;
+				return sys_pend(s, SysIo_Flush, f->host, f->buf, f->len);
+			}
+
+			int err = sys_flush_file(f);
+			if (err != 0) {
+				return -err;
+			}
+		}
+	}
+
+	return len;
+}
+
+// Keeps a write to the host's stdout or stderr, dropping whatever goes past SYS_MAX_OUTPUT
+static i32 sys_capture(Sys *s, u8 *src, u32 len) {
+	u32 n = SYS_MAX_OUTPUT - s->output_len;
+	n = n < len ? n : len;
+	if (s->output_len + n > s->output_cap) {
+		u32 cap = s->output_cap ? s->output_cap : SYS_BUF_SIZE;
+		while (cap < s->output_len + n) {
+			cap *= 2;
+		}
+		s->output = (u8 *)realloc(s->output, cap);
+		s->output_cap = cap;
+	}
+
+	memcpy(s->output + s->output_len, src, n);
+	s->output_len += n;
+	return len;
+}
+
+static i32 sys_write(Sys *s, u32 fd, u8 *src, u32 len) {
+	SysFile *f = sys_file(s, fd);
+	if (f == NULL) {
+		return -EBADF;
+	}
+
+	if (s->capture && !f->owned && (f->host == 1 || f->host == 2)) {
+		return sys_capture(s, src, len);
+	}
+
+	if (!f->buffered) {
+		if (s->async) {
+			return sys_pend(s, SysIo_Write, f->host, src, len);
+		}
+		ssize_t n = write(f->host, src, len);
+		return n < 0 ? -errno : n;
+	}
+
+	return sys_write_from(s, fd, src, len, 0);
+}
+
+static i32 sys_read(Sys *s, u32 fd, u8 *dst, u32 len) {
+	SysFile *f = sys_file(s, fd);
+	if (f == NULL) {
+		return -EBADF;
+	}
+
+	if (fd == 0 && s->input != NULL) {
+		u32 n = s->input_len - s->input_pos;
+		n = n < len ? n : len;
+		memcpy(dst, s->input + s->input_pos, n);
+		s->input_pos += n;
+		return n;
+	}
+
+	if (!f->regular) {
+		sys_flush_locked(s);
+	}
+	if (s->async) {
+		return sys_pend(s, SysIo_Read, f->host, dst, len);
+	}
+	ssize_t n = read(f->host, dst, len);
+	return n < 0 ? -errno : n;
+}
+
+// o32 open flags differ from the host's past the access mode
+static int sys_open_flags(u32 flags) {
+	int host = (flags & 3) | O_CLOEXEC;
+	if (flags & 0x0008) host |= O_APPEND;
+	if (flags & 0x0100) host |= O_CREAT;
+	if (flags & 0x0200) host |= O_TRUNC;
+	if (flags & 0x0400) host |= O_EXCL;
+	return host;
+}
+
+static i32 sys_open(Sys *s, char *path, u32 flags, u32 mode) {
+	u32 fd = 0;
+	while (fd < SYS_MAX_FILES && s->files[fd].host >= 0) {
+		fd++;
+	}
+	if (fd == SYS_MAX_FILES) {
+		return -EMFILE;
+	}
+
+	int host = open(path, sys_open_flags(flags), mode);
+	if (host < 0) {
+		return -errno;
+	}
+
+	SysFile *f = &s->files[fd];
+	f->host = host;
+	f->owned = true;
+	f->buffered = true;
+	f->regular = sys_regular(host);
+	f->len = 0;
+	return fd;
+}
+
+static i32 sys_close(Sys *s, u32 fd) {
+	SysFile *f = sys_file(s, fd);
+	if (f == NULL) {
+		return -EBADF;
+	}
+
+	int err = sys_flush_file(f);
+	if (f->owned && close(f->host) != 0 && err == 0) {
+		err = errno;
+	}
+
+	f->host = -1;
+	f->owned = false;
+	return -err;
+}
+
+static i32 sys_lseek(Sys *s, u32 fd, i32 offset, u32 whence) {
+	SysFile *f = sys_file(s, fd);
+	if (f == NULL) {
+		return -EBADF;
+	}
+
+	int err = sys_flush_file(f);
+	if (err != 0) {
+		return -err;
+	}
+
+	off_t pos = lseek(f->host, offset, whence);
+	if (pos < 0) {
+		return -errno;
+	}
+	return pos > INT32_MAX ? -EOVERFLOW : (i32)pos;
+}
+
+static i32 sys_fsync(Sys *s, u32 fd) {
+	SysFile *f = sys_file(s, fd);
+	if (f == NULL) {
+		return -EBADF;
+	}
+
+	int err = sys_flush_file(f);
+	if (err != 0) {
+		return -err;
+	}
+	return fsync(f->host) != 0 ? -errno : 0;
+}
+
+// Sets v0 and a3 from a result, negative for an errno
+static void sys_return(u32 *reg, i32 result) {
+	reg[2] = result < 0 ? -result : result;
+	reg[7] = result < 0;
+}
+
+// Finishes the call waiting in s->io, which the host answered with res; Sys_Io if there's another
+u32 sys_io_done(Sys *s, u32 *reg, i32 res) {
+	SysIo *io = &s->io;
+	if (io->op != SysIo_Flush) {
+		sys_return(reg, res);
+		return Sys_Continue;
+	}
+
+	SysFile *f = &s->files[io->fd];
+	if (res <= 0) {
+		f->len = 0;
+		sys_return(reg, res < 0 ? res : -EIO);
+		return Sys_Continue;
+	}
+
+	// A short write leaves the rest buffered
+	memmove(f->buf, f->buf + res, f->len - res);
+	f->len -= res;
+
+	pthread_mutex_lock(&s->lock);
+	i32 result = sys_write_from(s, io->fd, io->src, io->src_len, io->done);
+	pthread_mutex_unlock(&s->lock);
+
+	if (result == SYS_PENDING) {
+		return Sys_Io;
+	}
+	sys_return(reg, result);
+	return Sys_Continue;
+}
+
+/*
+ * Returns Sys_Exit once the guest has exited, with its status in a0.
+ * Sys_Yield and Sys_Sleep are left to whoever runs the guest: it either
+ * waits on the host (sys_wait) or parks the guest for sys_sleep_us().
+ * Sys_Spawn asks for a new hart, see hart_spawn. Sys_Io only comes from
+ * an async Sys.
+ */
+u32 syscall_exec(Sys *s, u32 *reg, u8 *mem) {
+	u32 syscall_num = reg[2];
+	u32 arg_1 = reg[4]; // a0
+	u32 arg_2 = reg[5]; // a1
+	u32 arg_3 = reg[6]; // a2
+	u32 arg_4 = reg[7]; // a3
+
+	u32 sys_id = syscall_num >= 0x4000 ? syscall_num - 0x4000 : syscall_num - 4000;
+	switch (sys_id) {
+		case 1: {
+			debug("Running exit\n");
+			sys_flush(s);
+			return Sys_Exit;
+		} break;
+		case 3: {
+			debug("Running read\n");
+			if (!sys_touch(mem, arg_2, arg_3)) {
+				sys_return(reg, -EFAULT);
+				break;
+			}
+			pthread_mutex_lock(&s->lock);
+			i32 result = sys_read(s, arg_1, mem + arg_2, arg_3);
+			pthread_mutex_unlock(&s->lock);
+			if (result == SYS_PENDING) {
+				return Sys_Io;
+			}
+			sys_return(reg, result);
+		} break;
+		case 4: {
+			debug("Running write\n");
+			if (!sys_touch(mem, arg_2, arg_3)) {
+				sys_return(reg, -EFAULT);
+				break;
+			}
+			pthread_mutex_lock(&s->lock);
+			i32 result = sys_write(s, arg_1, mem + arg_2, arg_3);
+			pthread_mutex_unlock(&s->lock);
+			if (result == SYS_PENDING) {
+				return Sys_Io;
+			}
+			sys_return(reg, result);
+		} break;
+		case 5: {
+			debug("Running open\n");
+			char path[4096];
+			u32 len = 0;
+			while (len < sizeof(path) && (path[len] = mem[(u32)(arg_1 + len)]) != '\0') {
+				len++;
+			}
+			if (len == sizeof(path)) {
+				sys_return(reg, -ENAMETOOLONG);
+				break;
+			}
+			pthread_mutex_lock(&s->lock);
+			sys_return(reg, sys_open(s, path, arg_2, arg_3));
+			pthread_mutex_unlock(&s->lock);
+		} break;
+		case 6: {
+			debug("Running close\n");
+			pthread_mutex_lock(&s->lock);
+			sys_return(reg, sys_close(s, arg_1));
+			pthread_mutex_unlock(&s->lock);
+		} break;
+		case 19: {
+			debug("Running lseek\n");
+			pthread_mutex_lock(&s->lock);
+			sys_return(reg, sys_lseek(s, arg_1, (i32)arg_2, arg_3));
+			pthread_mutex_unlock(&s->lock);
+		} break;
+		case 45: {
+			debug("Running brk\n");
+			sys_return(reg, s->heap != NULL ? (i32)heap_brk(s->heap, arg_1) : -ENOMEM);
+		} break;
+		// Anonymous only, and never MAP_FIXED; the fd and offset on the stack go unread
+		case 90: {
+			debug("Running mmap\n");
+			if (s->heap == NULL) {
+				sys_return(reg, -ENOMEM);
+			} else if (!(arg_4 & 0x800) || (arg_4 & 0x10)) {
+				sys_return(reg, (arg_4 & 0x800) ? -EINVAL : -ENODEV);
+			} else {
+				sys_return(reg, heap_mmap(s->heap, arg_2));
+			}
+		} break;
+		case 91: {
+			debug("Running munmap\n");
+			sys_return(reg, s->heap != NULL ? heap_munmap(s->heap, arg_1, arg_2) : -EINVAL);
+		} break;
+		case 118: {
+			debug("Running fsync\n");
+			pthread_mutex_lock(&s->lock);
+			sys_return(reg, sys_fsync(s, arg_1));
+			pthread_mutex_unlock(&s->lock);
+		} break;
+		case 162: {
+			debug("Running sched_yield\n");
+			sys_return(reg, 0);
+			return Sys_Yield;
+		} break;
+		case 166: {
+			debug("Running nanosleep\n");
+			sys_return(reg, 0);
+			return Sys_Sleep;
+		} break;
+		// Not o32: starts a hart at a0 with sp = a1 and a0 = a2
+		case 1000: {
+			debug("Running spawn\n");
+			return Sys_Spawn;
+		} break;
+		default: {
+			// As on Linux, the guest just gets ENOSYS
+			debug("syscall 0x%x not supported!\n", syscall_num);
+			sys_return(reg, -ENOSYS);
+		}
+	}
+
+	return Sys_Continue;
+}
+
+// How long a Sys_Sleep asked for, from the timespec at a0, in microseconds
+u64 sys_sleep_us(u32 *reg, u8 *mem) {
+	u32 req[2];
+	memcpy(req, mem + reg[4], sizeof(req));
+	return (u64)req[0] * 1000000 + req[1] / 1000;
+}
+
+void sys_wait(u32 action, u32 *reg, u8 *mem) {
+	if (action == Sys_Sleep) {
+		usleep(sys_sleep_us(reg, mem));
+	}
+}
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef TCACHE_H
+#define TCACHE_H
+
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "mips.h"
+
+/*
+ * On-disk cache of predecoded text, keyed by a hash of the input file.
+ * A cache file is a TcacheHdr followed by the Decoded records; records
+ * carry no host pointers, so a warm start just maps the file back in
+ * (MAP_PRIVATE, so re-decoding after guest code writes stays private).
+ *
+ * Files are written to a temporary name and renamed into place, so any
+ * number of emulators can share a directory and a reader only ever sees
+ * a complete file. Bump TCACHE_VERSION whenever decode_op changes.
+ */
+
+#define TCACHE_MAGIC 0x48434354
+#define TCACHE_VERSION 2
+
+typedef struct TcacheHdr {
+	u32 magic;
+	u32 version;
+	u32 record_size;
+	u32 num_kinds;
+	u64 hash;
+	u64 image_size;
+	u32 base;
+	u32 num_records;
+} TcacheHdr;
+
+// FNV-1a
+u64 hash_bytes(u8 *bytes, u64 size) {
+	u64 hash = 0xcbf29ce484222325ULL;
+	for (u64 i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+void tcache_path(char *path, u32 path_size, char *dir, u64 hash, u64 image_size) {
+	snprintf(path, path_size, "%s/%016llx-%llu.tc", dir,
+		(unsigned long long)hash, (unsigned long long)image_size);
+}
+
+void tcache_fill_hdr(TcacheHdr *hdr, u64 hash, u64 image_size, u32 base, u32 num_records) {
+	memset(hdr, 0, sizeof(TcacheHdr));
+	hdr->magic = TCACHE_MAGIC;
+	hdr->version = TCACHE_VERSION;
+	hdr->record_size = sizeof(Decoded);
+	hdr->num_kinds = Kind_Count;
+	hdr->hash = hash;
+	hdr->image_size = image_size;
+	hdr->base = base;
+	hdr->num_records = num_records;
+}
+
+/*
+ * Maps the cached records for an image, or returns NULL on a miss or a
+ * stale entry (other format version, decoder layout or load address).
+ */
+Decoded *tcache_load(char *dir, u64 hash, u64 image_size, u32 base, u32 num_records) {
+	char path[4096];
+	tcache_path(path, sizeof(path), dir, hash, image_size);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	TcacheHdr want;
+	tcache_fill_hdr(&want, hash, image_size, base, num_records);
+
+	u64 file_size = sizeof(TcacheHdr) + (u64)num_records * sizeof(Decoded);
+
+	struct stat st;
+	TcacheHdr have;
+	if (fstat(fd, &st) != 0 || (u64)st.st_size != file_size ||
+		read(fd, &have, sizeof(have)) != sizeof(have) || memcmp(&have, &want, sizeof(want)) != 0) {
+		debug("Stale cache entry %s\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	u8 *map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	return (Decoded *)(map + sizeof(TcacheHdr));
+}
+
+// Unmaps records tcache_load returned
+void tcache_unmap(Decoded *code, u32 num_records) {
+	munmap((u8 *)code - sizeof(TcacheHdr), sizeof(TcacheHdr) + (u64)num_records * sizeof(Decoded));
+}
+
+bool tcache_store(char *dir, u64 hash, u64 image_size, u32 base, Decoded *code, u32 num_records) {
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		printf("Unable to create cache directory %s!\n", dir);
+		return false;
+	}
+
+	char path[4096];
+	char tmp_path[4096 + 16];
+	tcache_path(path, sizeof(path), dir, hash, image_size);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+
+	int fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		return false;
+	}
+	fchmod(fd, 0644);
+
+	TcacheHdr hdr;
+	tcache_fill_hdr(&hdr, hash, image_size, base, num_records);
+
+	FILE *out = fdopen(fd, "wb");
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1 &&
+		fwrite(code, sizeof(Decoded), num_records, out) == num_records;
+	ok = (fclose(out) == 0) && ok;
+
+	if (!ok || rename(tmp_path, path) != 0) {
+		unlink(tmp_path);
+		return false;
+	}
+
+	return true;
+}
+
+#endif
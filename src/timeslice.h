@@ -0,0 +1,269 @@
+/*
+ * emu --batch --slice <n>: instead of running each job to completion,
+ * loads every job up front and time-slices them over the worker threads.
+ * Included by emu.c after batch.h.
+ *
+ * A job runs until it has used up n instructions, and is then stopped at
+ * the next block boundary (the interpreter charges a block's length when
+ * entering it) and put at the back of the run queue. Jobs that yield go
+ * to the back as well; jobs that sleep are parked in a heap ordered by
+ * wake time and only come back to the queue once they are due, so idle
+ * jobs cost nothing but their memory.
+ *
+ * With an io_uring, jobs' syscalls go async (see Sys_Io): a job that
+ * reads, or writes out a full buffer, is parked with its request queued
+ * on the ring, and the workers carry on with other jobs. Requests are
+ * submitted together, once the run queue is empty, URING_BATCH have
+ * piled up or every job runnable when the first was queued has had its
+ * turn. A reaper thread waits on completions and puts each job back in
+ * the queue. Without io_uring the syscalls block the worker as before.
+ */
+
+#define URING_BATCH 32
+#define URING_STOP UINT64_MAX
+
+typedef struct Sched {
+	Batch *batch;
+	i64 slice;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+
+	// Ring of runnable jobs; each job is in it at most once
+	u32 *queue;
+	u32 head;
+	u32 tail;
+	u32 size;
+
+	// Min-heap of sleeping jobs by wake_us
+	u32 *sleeping;
+	u32 num_sleeping;
+
+	u32 live;
+
+	// NULL if the host has no io_uring
+	Uring *ring;
+	pthread_t reaper;
+	// Queued requests go out once head gets here, see sched_submit
+	u32 submit_by;
+} Sched;
+
+static void sched_push(Sched *s, u32 job) {
+	s->queue[s->tail++ % s->size] = job;
+}
+
+static double sched_wake(Sched *s, u32 i) {
+	return s->batch->jobs[s->sleeping[i]].wake_us;
+}
+
+static void sched_swap(Sched *s, u32 a, u32 b) {
+	u32 tmp = s->sleeping[a];
+	s->sleeping[a] = s->sleeping[b];
+	s->sleeping[b] = tmp;
+}
+
+void sched_park(Sched *s, u32 job) {
+	u32 i = s->num_sleeping++;
+	s->sleeping[i] = job;
+
+	while (i > 0 && sched_wake(s, (i - 1) / 2) > sched_wake(s, i)) {
+		sched_swap(s, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+u32 sched_unpark(Sched *s) {
+	u32 job = s->sleeping[0];
+	s->sleeping[0] = s->sleeping[--s->num_sleeping];
+
+	u32 i = 0;
+	while (true) {
+		u32 least = i;
+		u32 l = 2 * i + 1;
+		u32 r = 2 * i + 2;
+		if (l < s->num_sleeping && sched_wake(s, l) < sched_wake(s, least)) least = l;
+		if (r < s->num_sleeping && sched_wake(s, r) < sched_wake(s, least)) least = r;
+		if (least == i) {
+			break;
+		}
+
+		sched_swap(s, i, least);
+		i = least;
+	}
+
+	return job;
+}
+
+// Queues the request job's syscall left in its Sys
+static void sched_queue_io(Sched *s, u32 job) {
+	SysIo *io = &s->batch->jobs[job].m->sys->io;
+	if (s->ring->pending == 0) {
+		s->submit_by = s->tail;
+	}
+	uring_queue(s->ring, io->op == SysIo_Read ? IORING_OP_READ : IORING_OP_WRITE,
+		io->host, io->buf, io->len, job);
+}
+
+static void sched_submit(Sched *s) {
+	if (s->ring != NULL && s->ring->pending > 0 && (s->head == s->tail ||
+		s->ring->pending >= URING_BATCH || (i32)(s->head - s->submit_by) >= 0)) {
+		uring_submit(s->ring);
+	}
+}
+
+void *sched_reaper(void *arg) {
+	Sched *s = (Sched *)arg;
+	Batch *b = s->batch;
+
+	bool stop = false;
+	while (!stop) {
+		uring_wait(s->ring);
+
+		pthread_mutex_lock(&s->lock);
+		u64 data;
+		i32 res;
+		while (uring_next(s->ring, &data, &res)) {
+			if (data == URING_STOP) {
+				stop = true;
+				continue;
+			}
+
+			Machine *m = b->jobs[data].m;
+			if (sys_io_done(m->sys, m->reg, res) == Sys_Io) {
+				sched_queue_io(s, data);
+			} else {
+				sched_push(s, data);
+			}
+		}
+		sched_submit(s);
+		pthread_cond_broadcast(&s->wake);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	return NULL;
+}
+
+void *sched_worker(void *arg) {
+	Sched *s = (Sched *)arg;
+	Batch *b = s->batch;
+
+	pthread_mutex_lock(&s->lock);
+	while (s->live > 0) {
+		sched_submit(s);
+
+		double now = now_us();
+		while (s->num_sleeping > 0 && sched_wake(s, 0) <= now) {
+			sched_push(s, sched_unpark(s));
+		}
+
+		if (s->head == s->tail) {
+			if (s->num_sleeping > 0) {
+				struct timespec until;
+				clock_gettime(CLOCK_REALTIME, &until);
+				u64 wait_ns = (sched_wake(s, 0) - now) * 1000;
+				until.tv_sec += (until.tv_nsec + wait_ns) / 1000000000;
+				until.tv_nsec = (until.tv_nsec + wait_ns) % 1000000000;
+				pthread_cond_timedwait(&s->wake, &s->lock, &until);
+			} else {
+				pthread_cond_wait(&s->wake, &s->lock);
+			}
+			continue;
+		}
+
+		u32 idx = s->queue[s->head++ % s->size];
+		pthread_mutex_unlock(&s->lock);
+
+		Job *job = &b->jobs[idx];
+		Machine *m = job->m;
+		m->budget = s->slice;
+
+		double start = now_us();
+		int status = run_guest(b->run, m);
+		job->ms += (now_us() - start) / 1000;
+
+		bool done = m->stop == Stop_Exit || m->stop == Stop_Fault;
+		if (done) {
+			job->status = status & 0xFF;
+			batch_free_job(m);
+		}
+
+		pthread_mutex_lock(&s->lock);
+		switch (m->stop) {
+			case Stop_Budget: case Stop_Yield: {
+				sched_push(s, idx);
+			} break;
+			case Stop_Sleep: {
+				job->wake_us = now_us() + m->sleep_us;
+				sched_park(s, idx);
+			} break;
+			case Stop_Io: {
+				sched_queue_io(s, idx);
+			} break;
+			default: {
+				s->live--;
+			}
+		}
+		pthread_cond_broadcast(&s->wake);
+
+		if (done) {
+			free(m);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+int run_sched(Batch *b, char *manifest, u32 num_workers, i64 slice) {
+	if (!batch_read_manifest(b, manifest) || !batch_prepare_texts(b)) {
+		return 1;
+	}
+
+	Sched s = {0};
+	s.batch = b;
+	s.slice = slice;
+	s.size = b->num_jobs + 1;
+	s.queue = (u32 *)malloc(s.size * sizeof(u32));
+	s.sleeping = (u32 *)malloc(s.size * sizeof(u32));
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.wake, NULL);
+	s.ring = uring_init(s.size);
+
+	for (u32 i = 0; i < b->num_jobs; i++) {
+		Job *job = &b->jobs[i];
+		job->m = (Machine *)calloc(1, sizeof(Machine));
+		if (!batch_load_job(b, job, job->m)) {
+			free(job->m);
+			continue;
+		}
+
+		job->m->sched = &s;
+		job->m->sys->async = s.ring != NULL;
+		sched_push(&s, i);
+		s.live++;
+	}
+
+	double start = now_us();
+
+	if (s.ring != NULL) {
+		pthread_create(&s.reaper, NULL, sched_reaper, &s);
+	}
+
+	b->num_workers = num_workers;
+	b->workers = (Worker *)calloc(num_workers, sizeof(Worker));
+	for (u32 i = 0; i < num_workers; i++) {
+		pthread_create(&b->workers[i].thread, NULL, sched_worker, &s);
+	}
+	for (u32 i = 0; i < num_workers; i++) {
+		pthread_join(b->workers[i].thread, NULL);
+	}
+
+	if (s.ring != NULL) {
+		uring_queue(s.ring, IORING_OP_NOP, -1, NULL, 0, URING_STOP);
+		uring_submit(s.ring);
+		pthread_join(s.reaper, NULL);
+		uring_free(s.ring);
+	}
+
+	return batch_report(b, (now_us() - start) / 1000);
+}
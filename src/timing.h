@@ -0,0 +1,261 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include "common.h"
+#include "mips.h"
+#include "machine.h"
+
+/*
+ * Cycle-approximate timing for a classic five stage MIPS pipeline
+ * (IF/ID/EX/MEM/WB) with forwarding, fed a block at a time from the
+ * interpreter's profiling hooks. Every instruction issues in one cycle,
+ * after the four it takes to fill the pipeline, plus:
+ *
+ * - a load-use stall when an instruction reads what the load before it
+ *   loaded, since the value only comes out of MEM;
+ * - a stall for mult/multu while the multiplier is still busy with the
+ *   last one, which takes TIMING_MULT_LATENCY cycles;
+ * - the delay slot of every taken branch or jump. The emulator doesn't
+ *   run delay slots (falling through, the next instruction is the slot
+ *   anyway), so the model charges the cycle the hardware spends on it;
+ * - a misprediction bubble for beq/bne. Branches resolve in EX, one
+ *   cycle later than the delay slot covers, so fetch follows the branch
+ *   predictor and loses a cycle whenever it guessed wrong.
+ *
+ * The predictor is nottaken (fetch just carries on), taken, or bimodal
+ * with a table of two bit counters indexed by pc. Stalls are charged to
+ * the block they happen in, so the report can give cycles and CPI per
+ * block. A block left part way through is counted as having run to its
+ * end.
+ */
+
+#define TIMING_FILL_CYCLES 4
+#define TIMING_MULT_LATENCY 5
+#define TIMING_TOP_BLOCKS 20
+
+enum {
+	Predict_NotTaken,
+	Predict_Taken,
+	Predict_Bimodal,
+};
+
+typedef struct Timing {
+	u8 predictor;
+	u8 *counters;
+	u32 counter_mask;
+
+	u64 cycles;
+	u64 instructions;
+	u64 load_use;
+	u64 mult;
+	u64 delay_slots;
+	u64 branches;
+	u64 mispredicts;
+
+	// How the block run last ends, waiting on whether its transfer was taken
+	bool pending;
+	u8 end_kind;
+	u32 end_pc;
+	u32 last_idx;
+	bool taken;
+	// Register the last instruction loaded into, 0 if it wasn't a load
+	u8 load_dest;
+	u64 mult_ready;
+
+	u32 code_base;
+	u32 code_size;
+	// Per block, by the text offset of its first word
+	u64 *block_cycles;
+	u64 *block_instructions;
+} Timing;
+
+Timing *timing_init(Machine *m, char *predictor) {
+	Timing *t = (Timing *)calloc(1, sizeof(Timing));
+	t->code_base = m->code_base;
+	t->code_size = m->code_size;
+	t->block_cycles = (u64 *)calloc(m->code_size + 1, sizeof(u64));
+	t->block_instructions = (u64 *)calloc(m->code_size + 1, sizeof(u64));
+	t->cycles = TIMING_FILL_CYCLES;
+
+	if (strcmp(predictor, "nottaken") == 0) {
+		t->predictor = Predict_NotTaken;
+	} else if (strcmp(predictor, "taken") == 0) {
+		t->predictor = Predict_Taken;
+	} else if (strncmp(predictor, "bimodal", 7) == 0) {
+		u32 entries = predictor[7] == ':' ? strtoul(predictor + 8, NULL, 0) : 1024;
+		if (entries == 0 || (entries & (entries - 1)) != 0) {
+			printf("The bimodal predictor needs a power of two number of entries\n");
+			return NULL;
+		}
+
+		t->predictor = Predict_Bimodal;
+		t->counter_mask = entries - 1;
+		t->counters = (u8 *)malloc(entries);
+		// Weakly not taken
+		memset(t->counters, 1, entries);
+	} else {
+		printf("Unknown branch predictor %s, expected nottaken, taken or bimodal[:<entries>]\n", predictor);
+		return NULL;
+	}
+
+	return t;
+}
+
+// Whether d reads register r
+static bool timing_reads(Decoded *d, u8 r) {
+	switch (d->kind) {
+		case Kind_Sll: {
+			return d->rt == r;
+		} break;
+		case Kind_Jr: case Kind_Addi: case Kind_Addiu: case Kind_Ori:
+		case Kind_Lb: case Kind_Lw: case Kind_Ll: {
+			return d->rs == r;
+		} break;
+		case Kind_Mult: case Kind_Multu: case Kind_Add: case Kind_Addu: case Kind_Sub:
+		case Kind_Beq: case Kind_Bne: case Kind_Sb: case Kind_Sw: case Kind_Sc: {
+			return d->rs == r || d->rt == r;
+		} break;
+		case Kind_Syscall: {
+			return r == 2 || (r >= 4 && r <= 7);
+		} break;
+		default: {
+			return false;
+		}
+	}
+}
+
+// Settles how the last block's final transfer went, now that it's known
+static void timing_settle(Timing *t) {
+	u64 cycles = 0;
+
+	switch (t->end_kind) {
+		case Kind_J: case Kind_Jal: case Kind_Jr: {
+			cycles++;
+			t->delay_slots++;
+		} break;
+		case Kind_Beq: case Kind_Bne: {
+			u32 pc = t->end_pc;
+			bool guess = false;
+			u8 *counter = NULL;
+			switch (t->predictor) {
+				case Predict_Taken: {
+					guess = true;
+				} break;
+				case Predict_Bimodal: {
+					counter = &t->counters[(pc >> 2) & t->counter_mask];
+					guess = *counter >= 2;
+				} break;
+				default: {}
+			}
+
+			t->branches++;
+			if (guess != t->taken) {
+				cycles++;
+				t->mispredicts++;
+			}
+			if (t->taken) {
+				cycles++;
+				t->delay_slots++;
+			}
+
+			if (counter != NULL) {
+				if (t->taken && *counter < 3) (*counter)++;
+				if (!t->taken && *counter > 0) (*counter)--;
+			}
+		} break;
+		default: {}
+	}
+
+	t->cycles += cycles;
+	t->block_cycles[t->last_idx] += cycles;
+	t->pending = false;
+	t->taken = false;
+}
+
+// Charges everything in b that doesn't depend on how it ends
+void timing_enter(Timing *t, Block *b) {
+	if (t->pending) {
+		timing_settle(t);
+	}
+
+	u32 idx = (b->pc - t->code_base) / 4;
+	u64 cycles = 0;
+	for (u32 i = 0; i < b->len; i++) {
+		Decoded *d = &b->ops[i];
+		cycles++;
+
+		if (t->load_dest != 0 && timing_reads(d, t->load_dest)) {
+			cycles++;
+			t->load_use++;
+		}
+
+		t->load_dest = 0;
+		switch (d->kind) {
+			case Kind_Lb: case Kind_Lw: case Kind_Ll: {
+				t->load_dest = d->rt;
+			} break;
+			case Kind_Mult: case Kind_Multu: {
+				u64 now = t->cycles + cycles;
+				if (t->mult_ready > now) {
+					cycles += t->mult_ready - now;
+					t->mult += t->mult_ready - now;
+					now = t->mult_ready;
+				}
+				t->mult_ready = now + TIMING_MULT_LATENCY;
+			} break;
+			default: {}
+		}
+	}
+
+	t->cycles += cycles;
+	t->instructions += b->len;
+	t->block_cycles[idx] += cycles;
+	t->block_instructions[idx] += b->len;
+
+	t->pending = true;
+	t->end_kind = b->ops[b->len - 1].kind;
+	t->end_pc = b->pc + (b->len - 1) * 4;
+	t->last_idx = idx;
+}
+
+static int timing_by_cycles(const void *a, const void *b, void *counts) {
+	u64 ca = ((u64 *)counts)[*(u32 *)a];
+	u64 cb = ((u64 *)counts)[*(u32 *)b];
+	if (ca != cb) {
+		return ca < cb ? 1 : -1;
+	}
+	return *(u32 *)a < *(u32 *)b ? -1 : 1;
+}
+
+void timing_report(Timing *t, FILE *out) {
+	if (t->pending) {
+		timing_settle(t);
+	}
+
+	fprintf(out, "%lu cycles for %lu instructions, CPI %.3f\n", t->cycles, t->instructions,
+		t->instructions ? (double)t->cycles / t->instructions : 0.0);
+	fprintf(out, "  %lu load-use stalls, %lu multiplier stalls, %lu delay slots\n",
+		t->load_use, t->mult, t->delay_slots);
+	fprintf(out, "  %lu branches, %lu mispredicted (%.1f%%)\n", t->branches, t->mispredicts,
+		t->branches ? 100.0 * t->mispredicts / t->branches : 0.0);
+
+	u32 *order = (u32 *)malloc((t->code_size + 1) * sizeof(u32));
+	u32 n = 0;
+	for (u32 i = 0; i <= t->code_size; i++) {
+		if (t->block_cycles[i] != 0) {
+			order[n++] = i;
+		}
+	}
+	qsort_r(order, n, sizeof(u32), timing_by_cycles, t->block_cycles);
+
+	fprintf(out, "\nblocks by cycles:      cycles  instructions    CPI\n");
+	for (u32 i = 0; i < n && i < TIMING_TOP_BLOCKS; i++) {
+		u32 idx = order[i];
+		fprintf(out, "  %08x %16lu %13lu  %5.3f\n", t->code_base + idx * 4, t->block_cycles[idx],
+			t->block_instructions[idx], (double)t->block_cycles[idx] / t->block_instructions[idx]);
+	}
+
+	free(order);
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <fcntl.h>
+#include <signal.h>
+
+#include "common.h"
+
+/*
+ * Binary execution trace. The interpreter appends one fixed-size TraceRec
+ * per instruction into a single-producer ring; head and tail are only
+ * ever advanced with atomic stores, so a flush can run from any thread or
+ * from a signal handler without taking a lock. The ring is written out
+ * in bulk whenever it fills, at exit, and from the crash handler.
+ * tracedump renders the resulting file as text.
+ */
+
+#define TRACE_MAGIC 0x4352544D
+#define TRACE_VERSION 1
+#define TRACE_RECORDS (1 << 16)
+
+typedef struct TraceHdr {
+	u32 magic;
+	u32 version;
+	u32 record_size;
+	u32 pad;
+} TraceHdr;
+
+typedef struct TraceRec {
+	u32 pc;
+	u32 op;
+	u32 value;
+	u32 addr;
+	u8 dest;
+	u8 pad[3];
+} TraceRec;
+
+typedef struct Trace {
+	int fd;
+	u32 mask;
+	u64 head;
+	u64 tail;
+	TraceRec *recs;
+} Trace;
+
+Trace *active_trace;
+
+void trace_flush(Trace *t) {
+	u64 head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+	u64 tail = __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+
+	while (tail < head) {
+		u32 start = tail & t->mask;
+		u64 count = head - tail;
+		if (count > t->mask + 1 - start) {
+			count = t->mask + 1 - start;
+		}
+
+		if (write(t->fd, &t->recs[start], count * sizeof(TraceRec)) < 0) {
+			break;
+		}
+		tail += count;
+	}
+
+	__atomic_store_n(&t->tail, tail, __ATOMIC_RELEASE);
+}
+
+static inline void trace_push(Trace *t, u32 pc, u32 op, u8 dest, u32 value, u32 addr) {
+	u64 head = t->head;
+	if (head - t->tail > t->mask) {
+		trace_flush(t);
+	}
+
+	TraceRec *r = &t->recs[head & t->mask];
+	r->pc = pc;
+	r->op = op;
+	r->value = value;
+	r->addr = addr;
+	r->dest = dest;
+
+	__atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_at_exit() {
+	if (active_trace != NULL) {
+		trace_flush(active_trace);
+	}
+}
+
+// Gets whatever is still in the ring onto disk, then dies as before
+void trace_on_crash(int sig) {
+	trace_at_exit();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+Trace *trace_open(char *path) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("Unable to open trace file %s!\n", path);
+		return NULL;
+	}
+
+	TraceHdr hdr = {0};
+	hdr.magic = TRACE_MAGIC;
+	hdr.version = TRACE_VERSION;
+	hdr.record_size = sizeof(TraceRec);
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		close(fd);
+		return NULL;
+	}
+
+	Trace *t = (Trace *)calloc(1, sizeof(Trace));
+	t->fd = fd;
+	t->mask = TRACE_RECORDS - 1;
+	t->recs = (TraceRec *)calloc(TRACE_RECORDS, sizeof(TraceRec));
+
+	active_trace = t;
+	atexit(trace_at_exit);
+	signal(SIGSEGV, trace_on_crash);
+	signal(SIGBUS, trace_on_crash);
+	signal(SIGILL, trace_on_crash);
+	signal(SIGFPE, trace_on_crash);
+	signal(SIGABRT, trace_on_crash);
+
+	return t;
+}
+
+#endif
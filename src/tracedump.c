@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "mips.h"
+#include "trace.h"
+
+int main(int argc, char *argv[]) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <trace_file>\n", argv[0]);
+		return 1;
+	}
+
+	FILE *in = fopen(argv[1], "rb");
+	if (in == NULL) {
+		printf("%s not found!\n", argv[1]);
+		return 1;
+	}
+
+	TraceHdr hdr;
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != TRACE_MAGIC ||
+		hdr.version != TRACE_VERSION || hdr.record_size != sizeof(TraceRec)) {
+		printf("%s is not a trace file!\n", argv[1]);
+		return 1;
+	}
+
+	TraceRec recs[4096];
+	size_t count;
+	while ((count = fread(recs, sizeof(TraceRec), 4096, in)) > 0) {
+		for (size_t i = 0; i < count; i++) {
+			TraceRec *r = &recs[i];
+
+			Decoded d;
+			decode_op(r->op, r->pc, &d);
+
+			char text[64];
+			disasm(&d, text, sizeof(text));
+			printf("%08x: %08x  %-28s", r->pc, r->op, text);
+
+			if (r->dest != 0) {
+				printf(" r%u = 0x%x", r->dest, r->value);
+			}
+
+			switch (d.kind) {
+				case Kind_Lb: case Kind_Lw: case Kind_Ll: case Kind_Sc: {
+					printf(" <- [0x%x]", r->addr);
+				} break;
+				case Kind_Sb: case Kind_Sw: {
+					printf(" [0x%x] = 0x%x", r->addr, r->value);
+				} break;
+				default: {}
+			}
+			printf("\n");
+		}
+	}
+
+	fclose(in);
+	return 0;
+}
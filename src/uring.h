@@ -0,0 +1,173 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "common.h"
+
+/*
+ * A bare io_uring, set up straight from the syscalls. uring_queue only
+ * fills in a submission entry; nothing reaches the kernel until
+ * uring_submit, which hands over everything queued since the last one
+ * in a single io_uring_enter. Queueing and submitting must be done by one
+ * thread at a time (the caller's lock), while another may sit in
+ * uring_wait and take completions off with uring_next.
+ */
+
+#define URING_MAX_ENTRIES 4096
+
+typedef struct Uring {
+	int fd;
+	u32 entries;
+
+	u32 *sq_head;
+	u32 *sq_tail;
+	u32 *sq_mask;
+	u32 *sq_array;
+	struct io_uring_sqe *sqes;
+
+	u32 *cq_head;
+	u32 *cq_tail;
+	u32 *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	// Queued, but not submitted yet
+	u32 pending;
+
+	u8 *sq_map;
+	u64 sq_map_size;
+	u8 *cq_map;
+	u64 cq_map_size;
+	u64 sqes_size;
+} Uring;
+
+static int uring_enter(int fd, u32 to_submit, u32 min_complete, u32 flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Returns NULL if the host has no io_uring (old kernel, seccomp, ...)
+Uring *uring_init(u32 entries) {
+	if (entries > URING_MAX_ENTRIES) {
+		entries = URING_MAX_ENTRIES;
+	}
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	Uring *r = (Uring *)calloc(1, sizeof(Uring));
+	r->fd = fd;
+	r->entries = p.sq_entries;
+
+	r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+	r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_map_size > r->sq_map_size) {
+			r->sq_map_size = r->cq_map_size;
+		}
+		r->cq_map_size = 0;
+	}
+
+	r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	r->cq_map = r->sq_map;
+	if (r->sq_map != MAP_FAILED && r->cq_map_size != 0) {
+		r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	}
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+	if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+		close(fd);
+		free(r);
+		return NULL;
+	}
+
+	r->sq_head = (u32 *)(r->sq_map + p.sq_off.head);
+	r->sq_tail = (u32 *)(r->sq_map + p.sq_off.tail);
+	r->sq_mask = (u32 *)(r->sq_map + p.sq_off.ring_mask);
+	r->sq_array = (u32 *)(r->sq_map + p.sq_off.array);
+	r->cq_head = (u32 *)(r->cq_map + p.cq_off.head);
+	r->cq_tail = (u32 *)(r->cq_map + p.cq_off.tail);
+	r->cq_mask = (u32 *)(r->cq_map + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(r->cq_map + p.cq_off.cqes);
+
+	return r;
+}
+
+void uring_free(Uring *r) {
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_map_size != 0) {
+		munmap(r->cq_map, r->cq_map_size);
+	}
+	munmap(r->sq_map, r->sq_map_size);
+	close(r->fd);
+	free(r);
+}
+
+// Hands everything queued to the kernel
+void uring_submit(Uring *r) {
+	while (r->pending > 0) {
+		int n = uring_enter(r->fd, r->pending, 0, 0);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+				continue;
+			}
+			printf("io_uring_enter failed: %s\n", strerror(errno));
+			return;
+		}
+		r->pending -= n;
+	}
+}
+
+// Queues a read or write at the file's current offset; data comes back with its completion
+void uring_queue(Uring *r, u8 opcode, int fd, void *buf, u32 len, u64 data) {
+	u32 tail = *r->sq_tail;
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->entries) {
+		uring_submit(r);
+	}
+
+	u32 idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (u64)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = (u64)-1;
+	sqe->user_data = data;
+
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->pending++;
+}
+
+// Blocks until there is at least one completion
+void uring_wait(Uring *r) {
+	while (__atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) == *r->cq_head) {
+		if (uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+			return;
+		}
+	}
+}
+
+// Takes the next completion, if there is one
+bool uring_next(Uring *r, u64 *data, i32 *res) {
+	u32 head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+	*data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+#endif
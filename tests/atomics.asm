@@ -0,0 +1,70 @@
+; ll/sc, sync and spawn: three harts and the main one each add 1000 to
+; a shared counter with ll/sc, then the main hart waits for the others
+; Exits 40 if no increment was lost, 1 otherwise
+
+start:
+    lui at worker
+    ori a0 at worker
+    addiu a1 zero 0
+    addiu v0 zero 0x43E8
+    syscall
+    addiu v0 zero 0x43E8
+    syscall
+    addiu v0 zero 0x43E8
+    syscall
+
+    lui at counter
+    ori t3 at counter
+    jal add_1000
+    nop
+
+    addiu t2 zero 3
+wait:
+    sync
+    lw t1 [t3 + 4]
+    bne t1 t2 wait
+    nop
+
+    lw t1 [t3 + 0]
+    ori t2 zero 4000
+    addiu a0 zero 40
+    beq t1 t2 exit
+    nop
+    addiu a0 zero 1
+exit:
+    addiu v0 zero 4001
+    syscall
+
+worker:
+    lui at counter
+    ori t3 at counter
+    jal add_1000
+    nop
+done:
+    ll t1 [t3 + 4]
+    addiu t1 t1 1
+    sc t1 [t3 + 4]
+    beq t1 zero done
+    nop
+    addiu a0 zero 0
+    addiu v0 zero 4001
+    syscall
+
+; Adds 1000 to the word at t3
+add_1000:
+    addiu t0 zero 1000
+retry:
+    ll t1 [t3 + 0]
+    addiu t1 t1 1
+    sc t1 [t3 + 0]
+    beq t1 zero retry
+    nop
+    addiu t0 t0 -1
+    bne t0 zero retry
+    nop
+    jr ra
+    nop
+
+counter:
+    dw 0
+    dw 0
@@ -0,0 +1,55 @@
+; open, write, lseek, read and close: writes "MIPS HELLO\n" to
+; /tmp/mips_file_io, seeks back to offset 5 and reads the rest
+; Exits 11 (where lseek left it plus what read returned) if the read
+; starts at the H, 1 otherwise
+
+main:
+    lui at path
+    ori a0 at path
+    ori a1 zero 0x302 ; O_RDWR | O_CREAT | O_TRUNC
+    ori a2 zero 420
+    addiu v0 zero 4005
+    syscall
+    addu s0 v0 zero
+
+    addu a0 s0 zero
+    lui at msg
+    ori a1 at msg
+    addiu a2 zero 11
+    addiu v0 zero 4004
+    syscall
+
+    addu a0 s0 zero
+    addiu a1 zero 5
+    addiu a2 zero 0 ; SEEK_SET
+    addiu v0 zero 4019
+    syscall
+    addu s1 v0 zero
+
+    addu a0 s0 zero
+    addiu a1 sp -64
+    addiu a2 zero 32
+    addiu v0 zero 4003
+    syscall
+    addu s1 s1 v0
+
+    addu a0 s0 zero
+    addiu v0 zero 4006
+    syscall
+
+    addu a0 s1 zero
+    lb t0 [sp + -64]
+    addiu t1 zero 0x48
+    beq t0 t1 exit
+    nop
+    addiu a0 zero 1
+exit:
+    addiu v0 zero 4001
+    syscall
+
+path:
+    db "/tmp/mips_file_io"
+    db 0
+msg:
+    db "MIPS HELLO"
+    db 0xa
@@ -0,0 +1,58 @@
+; brk, mmap and munmap: grows the break by 5000 bytes and uses the top
+; byte, then maps two pages, unmaps them and maps one page again, which
+; should reuse the first of them and read back as zero
+; Exits 45 if all of that holds, 1 otherwise
+
+main:
+    addiu a0 zero 0
+    addiu v0 zero 4045
+    syscall
+    addu s0 v0 zero
+
+    addiu a0 s0 5000
+    addiu v0 zero 4045
+    syscall
+    addiu t0 s0 5000
+    bne v0 t0 fail
+    nop
+    addiu t1 zero 5
+    sb t1 [s0 + 4999]
+    lb t2 [s0 + 4999]
+    bne t1 t2 fail
+    nop
+
+    addiu a0 zero 0
+    ori a1 zero 8192
+    addiu a2 zero 3 ; PROT_READ | PROT_WRITE
+    ori a3 zero 0x802 ; MAP_PRIVATE | MAP_ANONYMOUS
+    addiu v0 zero 4090
+    syscall
+    addu s1 v0 zero
+    addiu t1 zero 99
+    sw t1 [s1 + 0]
+
+    addu a0 s1 zero
+    ori a1 zero 8192
+    addiu v0 zero 4091
+    syscall
+
+    addiu a0 zero 0
+    ori a1 zero 4096
+    addiu a2 zero 3
+    ori a3 zero 0x802
+    addiu v0 zero 4090
+    syscall
+    bne v0 s1 fail
+    nop
+    lw t1 [v0 + 0]
+    bne t1 zero fail
+    nop
+
+    addiu a0 zero 45
+    addiu v0 zero 4001
+    syscall
+
+fail:
+    addiu a0 zero 1
+    addiu v0 zero 4001
+    syscall
@@ -0,0 +1,34 @@
+; For --batch --slice: a one block loop, which a slice can end in the
+; middle of, then sched_yield and a short nanosleep, three times over
+; Exits 7 once it's done, whatever the slice; run it as a job, e.g.
+; ./emu --batch jobs.txt --threads 1 --slice 1
+
+start:
+    addiu s0 zero 3
+again:
+    ori t0 zero 10000
+spin:
+    addiu t0 t0 -1
+    bne t0 zero spin
+    nop
+
+    addiu v0 zero 4162 ; sched_yield
+    syscall
+
+    lui at ts
+    ori a0 at ts
+    addiu a1 zero 0
+    addiu v0 zero 4166 ; nanosleep
+    syscall
+
+    addiu s0 s0 -1
+    bne s0 zero again
+    nop
+
+    addiu a0 zero 7
+    addiu v0 zero 4001
+    syscall
+
+ts:
+    dw 0
+    dw 1000000